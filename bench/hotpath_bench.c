@@ -0,0 +1,342 @@
+/*
+    Hot path microbenchmarks
+
+    Builds protocol.c, sim.c and datalink.c into this program, links the
+    other physical layer objects, and runs their per-byte and per-frame
+    paths without a peer: two stations of a --sim run, the virtual clock
+    standing still, with the line stubbed out by handing one station's
+    sending queue straight to the other's frame reassembly. Measures
+
+      crc32()                      ns/byte, every engine this CPU has
+      send_frame()                 ns/byte of frame, encoding into sq
+      frame reassembly             ns/byte of line, as wait_for_event() runs it
+      get_packet(), put_packet()   ns/byte of packet
+      lprintf(), __v_lprintf()     ns/call, dbg_frame() formats, to /dev/null
+      dbg_frame()                  ns/call with the frame debug bit off
+      datalink events              ns/event: NETWORK_LAYER_READY, and
+                                   FRAME_RECEIVED of a DATA frame with an ACK
+
+    and writes them as JSON, to stdout or the file given.
+
+    Usage: hotpath_bench [output.json]
+*/
+
+#define main datalink_main
+#include "../protocol.c"
+#include "../sim.c"
+#include "../datalink.c"
+#undef main
+
+#define MIN_SECS 0.2 /* per measurement */
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static FILE *out;
+static int nresults;
+
+static void result(const char *name, const char *unit, double value)
+{
+    fprintf(out, "%s    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f}", nresults++ ? ",\n" : "", name, unit,
+        value);
+    /* stdout is sent to /dev/null for the lprintf() runs, nothing may wait in its buffer then */
+    fflush(out);
+    fprintf(stderr, "%-28s %10.3f %s\n", name, value, unit);
+}
+
+/* Run 'fn' in batches of 'batch' until MIN_SECS have passed, returns ns per call */
+static double measure(void (*fn)(void), int batch)
+{
+    double t0 = now_sec(), t;
+    long long calls = 0;
+    int i;
+
+    do {
+        for (i = 0; i < batch; i++)
+            fn();
+        calls += batch;
+        t = now_sec() - t0;
+    } while (t < MIN_SECS);
+    return t * 1e9 / calls;
+}
+
+static struct STATION *sa, *sb;
+static LINK *la, *lb;
+static unsigned char buf[65536], frame[PKT_LEN + 16], line[64 * 1024];
+static int buf_len, frame_len, line_len;
+
+/* crc32() */
+static void bench_crc32(void)
+{
+    crc32(buf, buf_len);
+}
+
+/* send_frame() into station A's sending queue, the line never taking any */
+static void bench_send_frame(void)
+{
+    send_frame(frame, frame_len);
+    if (sq_len() > SQ_SIZE / 2)
+        ch->sq_head = ch->sq_tail = 0;
+}
+
+/* frame reassembly of 'line' by station B, the frames then released */
+static void bench_decode(void)
+{
+    frame_decode(line, line_len);
+    if (!st->rf_hdr_ready)
+        frame_header_check();
+    while (st->rf_head)
+        recv_frame_release();
+}
+
+static unsigned char packet[PKT_LEN];
+
+static void bench_get_packet(void)
+{
+    st->layer3_ready = 1;
+    get_packet(packet);
+}
+
+/* station A's packets, in order, checked by station B over and over */
+static unsigned char packets[64][PKT_LEN];
+static unsigned int packets_seed; /* station A's generator before packets[0] */
+
+static void bench_put_packet(void)
+{
+    static int k;
+
+    if (k == 64) {
+        st->rand_a = packets_seed;
+        k = 0;
+    }
+    put_packet(packets[k++], PKT_LEN);
+}
+
+static const char *dbg_fmt = "Send DATA %d, Seq Num %d, Piggybacking %d, ID %d\n";
+
+static void bench_lprintf(void)
+{
+    lprintf(dbg_fmt, 17, 17, 42, 10173);
+}
+
+static void v_call(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    __v_lprintf(fmt, ap);
+    va_end(ap);
+}
+
+static void bench_v_lprintf(void)
+{
+    v_call("Recv DATA %d, Piggybacking ACK %d, ID %d\n", 17, 42, 20173);
+}
+
+static void bench_dbg_frame(void)
+{
+    dbg_frame((char *)dbg_fmt, 17, 17, 42, 10173);
+}
+
+/* Line bytes sent by station 's' since the last call, reassembled by its peer */
+static int deliver(struct STATION *s, struct STATION *peer)
+{
+    struct CHANNEL *c = s->chan[0];
+    int n = (c->sq_tail - c->sq_head + SQ_SIZE) % SQ_SIZE;
+
+    station_enter(peer);
+    frame_decode(c->sq + c->sq_head, n); /* never wraps: sq is emptied every time */
+    c->sq_head = c->sq_tail = 0;
+    return n;
+}
+
+static double dl_send_ns, dl_recv_ns;
+static long long dl_sends, dl_recvs;
+
+/*
+    One DATA frame each way, the other station's ACK riding on it. The
+    line takes the sending queue at once, and PHYSICAL_LAYER_READY
+    follows as phl_poll() would raise it.
+*/
+static void bench_datalink(void)
+{
+    struct STATION *s, *peer;
+    LINK *l, *lp;
+    double t;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        s = i ? sb : sa;
+        peer = i ? sa : sb;
+        l = i ? lb : la;
+        lp = i ? la : lb;
+
+        station_enter(s);
+        if (s->network_layer_active) {
+            s->layer3_ready = 1;
+            t = now_sec();
+            link_event(l, NETWORK_LAYER_READY, 0);
+            dl_send_ns += now_sec() - t;
+            dl_sends++;
+        }
+
+        deliver(s, peer);
+        while (st->rf_head) {
+            t = now_sec();
+            link_event(lp, FRAME_RECEIVED, 0);
+            dl_recv_ns += now_sec() - t;
+            dl_recvs++;
+        }
+
+        station_enter(s);
+        if (s->inform_phl_ready && phl_sq_len() < PHL_SQ_LEVEL) {
+            s->inform_phl_ready = 0;
+            link_event(l, PHYSICAL_LAYER_READY, 0);
+        }
+    }
+}
+
+/* The line bytes of 'n' DATA frames as station A's datalink sends them */
+static int data_frames(unsigned char *p, int n)
+{
+    struct CHANNEL *c = sa->chan[0];
+    int len = 0, k;
+
+    station_enter(sa);
+    for (k = 0; k < n; k++) {
+        frame[0] = FRAME_DATA;
+        frame[1] = (unsigned char)k;
+        frame[2] = (unsigned char)k;
+        st->layer3_ready = 1;
+        get_packet(frame + 3);
+        frame_len = fcs_append(frame, 3 + PKT_LEN);
+        send_frame(frame, frame_len);
+        memcpy(p + len, c->sq + c->sq_head, c->sq_tail - c->sq_head);
+        len += c->sq_tail - c->sq_head;
+        c->sq_head = c->sq_tail = 0;
+    }
+    return len;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *engines[] = { "byte", "slice8", "slice16", "clmul" };
+    char name[64];
+    int i, fd, saved;
+    double ns;
+
+    out = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if (out == NULL) {
+        printf("Cannot write %s\n", argv[1]);
+        return 1;
+    }
+
+    /* the stations of a simulation that never lets the clock move */
+    layer2_ctx_size = sizeof(LINK);
+    layer2_init = link_init;
+    layer2_handler = link_event;
+    mode_sim = 1;
+    mode_loop = LOOP_SIM;
+    ber = 0.0;
+    sim_us = 0;
+    mode_rate[0] = CHAN_BPS;
+    fcs_select(FCS_CRC32);
+    magic_init();
+    lprintf_quiet(1);
+    sim_station(0);
+    sim_station(1);
+    lprintf_quiet(0);
+    sa = sim_sts[0];
+    sb = sim_sts[1];
+    la = (LINK *)sa->ctx;
+    lb = (LINK *)sb->ctx;
+
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"fcs\": \"%s\",\n  \"results\": [\n", VERSION,
+        fcs_name(fcs_type()));
+
+    /* crc32(): a frame, and a large buffer */
+    for (i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = (unsigned char)(i * 7 + 3);
+    for (i = 0; i < (int)(sizeof(engines) / sizeof(engines[0])); i++) {
+        if (!crc32_set_engine(engines[i]))
+            continue;
+        buf_len = PKT_LEN + 3;
+        snprintf(name, sizeof name, "crc32_%s_frame", engines[i]);
+        result(name, "ns/byte", measure(bench_crc32, 1000) / buf_len);
+        buf_len = sizeof(buf);
+        snprintf(name, sizeof name, "crc32_%s_64k", engines[i]);
+        result(name, "ns/byte", measure(bench_crc32, 10) / buf_len);
+    }
+    crc32_set_engine("auto");
+
+    /* send_frame() of a DATA frame, held in the sending queue */
+    line_len = data_frames(line, 200);
+    station_enter(sa);
+    ch->tx_blocked = 1;
+    result("send_frame", "ns/byte", measure(bench_send_frame, 100) / frame_len);
+    ch->tx_blocked = 0;
+    ch->sq_head = ch->sq_tail = 0;
+
+    /* reassembly of the line bytes of 200 DATA frames */
+    station_enter(sb);
+    result("frame_decode", "ns/byte", measure(bench_decode, 1) / line_len);
+
+    /* network layer: station A's packets made, and checked by station B */
+    station_enter(sa);
+    result("get_packet", "ns/byte", measure(bench_get_packet, 100) / PKT_LEN);
+    packets_seed = sa->rand_a;
+    for (i = 0; i < 64; i++) {
+        st->layer3_ready = 1;
+        get_packet(packets[i]);
+    }
+    station_enter(sb);
+    sb->rand_a = packets_seed;
+    result("put_packet", "ns/byte", measure(bench_put_packet, 64) / PKT_LEN);
+
+    /* logging, with the console and the log file on /dev/null */
+    fflush(stdout);
+    saved = dup(1);
+    fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 1);
+    log_file = fopen("/dev/null", "w");
+    ns = measure(bench_lprintf, 100);
+    fflush(stdout);
+    dup2(saved, 1);
+    result("lprintf", "ns/call", ns);
+    dup2(fd, 1);
+    ns = measure(bench_v_lprintf, 100);
+    fflush(stdout);
+    dup2(saved, 1);
+    result("v_lprintf", "ns/call", ns);
+    fclose(log_file);
+    log_file = NULL;
+    close(fd);
+    close(saved);
+    debug_mask = 0;
+    result("dbg_frame_off", "ns/call", measure(bench_dbg_frame, 1000));
+
+    /* datalink.c: both stations sending, each frame acknowledging the other's */
+    sa->rand_a = sb->rand_a = 0x65109bc4;
+    sa->rand_b = sb->rand_b = 0x1e459090;
+    sa->rpackets = sb->rpackets = 0;
+    sa->chan[0]->tx_blocked = sb->chan[0]->tx_blocked = 1;
+    station_enter(sa);
+    link_event(la, PHYSICAL_LAYER_READY, 0);
+    station_enter(sb);
+    link_event(lb, PHYSICAL_LAYER_READY, 0);
+    measure(bench_datalink, 100);
+    result("datalink_network_layer_ready", "ns/event", dl_send_ns * 1e9 / dl_sends);
+    result("datalink_frame_received", "ns/event", dl_recv_ns * 1e9 / dl_recvs);
+    if (sb->rpackets == 0 || sa->rpackets == 0)
+        fprintf(stderr, "WARNING: no packet got through the data link layer\n");
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
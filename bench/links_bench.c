@@ -0,0 +1,87 @@
+/*
+    Multi-link engine scaling benchmark
+
+    Runs ./datalink --links over a grid of link and core counts, flooding
+    every link on a noisy line, and reports the aggregate frame rate the
+    engine sustains, per link and per shard thread.
+
+    Usage: links_bench [seconds-per-case [bps [links ...]]]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const int def_links[] = { 1, 4, 16, 64, 256 };
+static const int cores[] = { 1, 2, 4, 8 };
+
+struct result {
+    double frames, packets, wakeups, syscalls, cpu;
+};
+
+/* one engine run, 0 if it did not report */
+static int run(int links, int ncores, int secs, const char *bps, struct result *r)
+{
+    char cmd[256], line[512], *p;
+    int got = 0;
+    FILE *f;
+
+    snprintf(cmd, sizeof cmd, "./datalink --links=%d --cores=%d --flood --nolog --ber=1e-5 "
+        "--rate=%s --ttl=%d 2>&1", links, ncores, bps, secs);
+    f = popen(cmd, "r");
+    if (f == NULL)
+        return 0;
+
+    memset(r, 0, sizeof *r);
+    while (fgets(line, sizeof line, f)) {
+        if ((p = strstr(line, "Engine: ")) == NULL)
+            continue;
+        if (strstr(p, "frames ("))
+            got += sscanf(strstr(p, "frames (") + 8, "%lf", &r->frames) +
+                sscanf(strstr(p, "received (") + 10, "%lf", &r->packets);
+        else if (strstr(p, "wakeups ("))
+            got += sscanf(strstr(p, "wakeups (") + 9, "%lf", &r->wakeups) +
+                sscanf(strstr(p, "/s), ") + 5, "%lf", &r->syscalls) +
+                sscanf(strstr(p, "CPU ") + 4, "%lf", &r->cpu);
+    }
+    pclose(f);
+    return got == 5;
+}
+
+int main(int argc, char **argv)
+{
+    int secs = argc > 1 ? atoi(argv[1]) : 3;
+    const char *bps = argc > 2 ? argv[2] : "1000000";
+    int count = argc > 3 ? argc - 3 : (int)(sizeof(def_links) / sizeof(def_links[0]));
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, c, links;
+    struct result r;
+
+    if (access("./datalink", X_OK) != 0) {
+        printf("Run from the directory holding the datalink binary\n");
+        return 1;
+    }
+
+    printf("%ld CPUs, %s bps lines, %d s per case\n", nproc, bps, secs);
+    printf("%6s %6s %12s %14s %12s %12s %10s %6s\n", "links", "cores", "frames/s", "frames/s/link",
+        "packets/s", "wakeups/s", "sys/frame", "CPU%");
+    for (i = 0; i < count; i++) {
+        links = argc > 3 ? atoi(argv[i + 3]) : def_links[i];
+        if (links <= 0)
+            continue;
+        for (c = 0; c < (int)(sizeof(cores) / sizeof(cores[0])); c++) {
+            /* more shards than links or CPUs only measures contention */
+            if (cores[c] > links || (c > 0 && cores[c] > nproc))
+                break;
+            if (!run(links, cores[c], secs, bps, &r)) {
+                printf("%6d %6d   no engine report (built without --links support?)\n", links, cores[c]);
+                return 1;
+            }
+            printf("%6d %6d %12.0f %14.1f %12.0f %12.1f %10.2f %6.0f\n", links, cores[c], r.frames,
+                r.frames / links, r.packets, r.wakeups, r.syscalls, r.cpu);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+    Reference binary benchmark
+
+    Runs ./datalink and the stopwait, gobackn and selective binaries of
+    DescriptionAndExample/Lab1-linux/Examples side by side, station A
+    and B of each over TCP on a port of its own, under the same channel
+    options and time to live. The channels only match in their bit error
+    rate, not in where the errors fall: the reference binaries draw noise
+    per received block, datalink per delay-line span, and their pacing
+    differs too. Compare long runs. From the logs it takes the last
+    ".... N packets received, X bps, Y%" line of each station, and from
+    the frame debug output the DATA frames sent against the packets they
+    carried: the retransmission overhead.
+
+    The reference binaries are 32-bit x86 and checked in without the
+    execute bit. They need chmod +x and the i386 C runtime (libc6-i386,
+    or libc6:i386 on a multiarch system).
+
+    Exits with 1 if datalink is more than a point of efficiency behind
+    a reference binary on either station in any case, and with 2 if no
+    reference binary reported in any case, so nothing was compared.
+
+    Usage: ref_bench [seconds-per-case ["options" ...]]
+      e.g. ref_bench 120 "--flood" "--flood --ber=1e-4"
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REF_DIR "DescriptionAndExample/Lab1-linux/Examples/"
+#define NBIN    4
+#define PORT    59300
+#define MAX_ID  30000 /* packet IDs: station number * 10000 + packet number % 10000 */
+
+/* the cases of the performance record sheet */
+static const char *def_cases[] = { "--utopia", "", "--flood --utopia", "--flood", "--flood --ber=1e-4" };
+
+static const char *bins[NBIN] = { "./datalink", REF_DIR "stopwait", REF_DIR "gobackn", REF_DIR "selective" };
+static const char *names[NBIN] = { "datalink", "stopwait", "gobackn", "selective" };
+
+struct result {
+    int ok;
+    double bps[2], eff[2];
+    unsigned int sent[2], distinct[2]; /* DATA frames sent, packets among them */
+};
+
+static char dir[] = "/tmp/refbenchXXXXXX";
+static unsigned char seen[MAX_ID];
+
+/* Goodput, efficiency and DATA frames of the station that wrote log 'fname' */
+static int parse_log(const char *fname, double *bps, double *eff, unsigned int *sent, unsigned int *distinct)
+{
+    char line[512], *p;
+    int got = 0, id;
+    FILE *f = fopen(fname, "r");
+
+    *sent = *distinct = 0;
+    if (f == NULL)
+        return 0;
+    memset(seen, 0, sizeof seen);
+    while (fgets(line, sizeof line, f)) {
+        if ((p = strstr(line, "Send DATA")) != NULL) {
+            (*sent)++;
+            if ((p = strstr(p, "ID ")) != NULL && sscanf(p + 3, "%d", &id) == 1 && id >= 0 && id < MAX_ID &&
+                !seen[id]) {
+                seen[id] = 1;
+                (*distinct)++;
+            }
+        } else if (strstr(line, "FATAL: ")) {
+            got = 0;
+            break;
+        } else if ((p = strstr(line, ".... ")) != NULL && (p = strstr(p, "packets received, ")) != NULL)
+            got = sscanf(p + 18, "%lf bps, %lf", bps, eff) == 2;
+    }
+    fclose(f);
+    return got;
+}
+
+/* Every binary's station A, then B, all at once; returns once they have all quit */
+static void run_case(const char *opts, int secs, struct result *r)
+{
+    char cmd[512], log[128];
+    FILE *p[NBIN][2];
+    int i, k;
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < NBIN; i++) {
+            p[i][k] = NULL;
+            if (access(bins[i], X_OK) != 0)
+                continue;
+            snprintf(cmd, sizeof cmd, "%s --port=%d --ttl=%d --debug=2 --log=%s/%s-%c.log %s %c >/dev/null 2>&1",
+                bins[i], PORT + i, secs, dir, names[i], "AB"[k], opts, "AB"[k]);
+            p[i][k] = popen(cmd, "r");
+        }
+        if (k == 0)
+            sleep(1); /* the reference stations B do not wait for A to listen */
+    }
+
+    for (i = 0; i < NBIN; i++) {
+        r[i].ok = 1;
+        for (k = 0; k < 2; k++) {
+            if (p[i][k] == NULL) {
+                r[i].ok = 0;
+                continue;
+            }
+            while (fgets(cmd, sizeof cmd, p[i][k]))
+                ;
+            pclose(p[i][k]);
+            snprintf(log, sizeof log, "%s/%s-%c.log", dir, names[i], "AB"[k]);
+            if (!parse_log(log, &r[i].bps[k], &r[i].eff[k], &r[i].sent[k], &r[i].distinct[k]))
+                r[i].ok = 0;
+            remove(log);
+        }
+    }
+}
+
+static double overhead(const struct result *r, int k)
+{
+    return r->distinct[k] ? 100.0 * (r->sent[k] - r->distinct[k]) / r->distinct[k] : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    int secs = argc > 1 ? atoi(argv[1]) : 120;
+    int count = argc > 2 ? argc - 2 : (int)(sizeof(def_cases) / sizeof(def_cases[0]));
+    int c, i, k, behind = 0, compared = 0;
+    struct result r[NBIN];
+    const char *opts;
+
+    if (access("./datalink", X_OK) != 0) {
+        printf("Run from the directory holding the datalink binary\n");
+        return 1;
+    }
+    for (i = 1; i < NBIN; i++) {
+        if (access(bins[i], X_OK) != 0)
+            printf("%s: not executable here (chmod +x, and 32-bit x86 support needed), left out\n", bins[i]);
+    }
+    if (mkdtemp(dir) == NULL) {
+        printf("Cannot create a directory for the logs\n");
+        return 1;
+    }
+
+    printf("%d s per case, all binaries at once, ports %d-%d\n", secs, PORT, PORT + NBIN - 1);
+    for (c = 0; c < count; c++) {
+        opts = argc > 2 ? argv[c + 2] : def_cases[c];
+        run_case(opts, secs, r);
+
+        printf("\n%s\n", opts[0] ? opts : "(no options)");
+        printf("%10s %10s %8s %10s %10s %8s %10s\n", "", "A bps", "A %", "A rexmit%", "B bps", "B %", "B rexmit%");
+        for (i = 0; i < NBIN; i++) {
+            if (!r[i].ok) {
+                printf("%10s   no report\n", names[i]);
+                continue;
+            }
+            printf("%10s %10.0f %8.2f %10.1f %10.0f %8.2f %10.1f\n", names[i], r[i].bps[0], r[i].eff[0],
+                overhead(&r[i], 0), r[i].bps[1], r[i].eff[1], overhead(&r[i], 1));
+        }
+
+        /* datalink against the best reference on each station */
+        for (i = 1; i < NBIN; i++) {
+            if (r[0].ok && r[i].ok)
+                compared = 1;
+            for (k = 0; r[0].ok && r[i].ok && k < 2; k++) {
+                if (r[0].eff[k] < r[i].eff[k] - 1.0) {
+                    printf("datalink is %.2f points behind %s on station %c\n", r[i].eff[k] - r[0].eff[k],
+                        names[i], "AB"[k]);
+                    behind = 1;
+                }
+            }
+        }
+        if (!r[0].ok)
+            behind = 1;
+    }
+
+    rmdir(dir);
+    if (!compared) {
+        printf("\nNo reference binary reported, nothing was compared\n");
+        return 2;
+    }
+    return behind;
+}
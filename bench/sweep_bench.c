@@ -0,0 +1,306 @@
+/*
+    Parameter sweep
+
+    Builds the data link layer once per combination of MAX_SEQ,
+    DATA_TIMER and ACK_TIMER (make datalink-variant, so the objects
+    linked are the Makefile's), runs every build under every traffic mode
+    and bit error rate, as many runs at a time as there are CPUs, and
+    writes the goodput and line efficiency of both stations (the figures
+    put_packet() reports) to <prefix>.csv and <prefix>.json, next to
+    those of the performance record sheet where it has the case.
+
+    Runs are --sim runs of --ttl seconds of line time: the same seed
+    gives the same figures. With -r they are real time runs of station
+    A and B forked by --transport=pair instead.
+
+    Usage: sweep_bench [-r] [-t seconds] [-j jobs] [-s seed] [-o prefix]
+                       [-b ber,...] [-m normal|flood|ibib,...]
+                       [-w max_seq,...] [-D data_timer_ms,...] [-A ack_timer_ms,...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LIST 16
+
+/* 性能测试记录表-参考数据: line efficiency (%), station A and B */
+static const struct {
+    const char *mode;
+    double ber;
+    double gbn_a, gbn_b, sr_a, sr_b;
+} refs[] = {
+    { "normal", 0,    51.6, 97.0, 53.9, 97.0 }, /* --utopia */
+    { "normal", 1e-5, 47.7, 86.9, 52.9, 95.1 }, /* no options */
+    { "flood",  0,    97.0, 97.0, 97.0, 97.0 }, /* --flood --utopia */
+    { "flood",  1e-5, 88.1, 87.7, 95.0, 95.1 }, /* --flood */
+    { "flood",  1e-4, 23.1, 46.8, 42.0, 73.6 }, /* --flood --ber=1e-4 */
+};
+
+struct list {
+    int n;
+    char *v[MAX_LIST];
+};
+
+struct run {
+    int build;          /* index into the builds */
+    int mode, ber;      /* indexes into the lists */
+    double bps[2], eff[2];
+    int status;         /* RUN_OK, ... */
+};
+
+#define RUN_OK        0
+#define RUN_NO_REPORT 1 /* the station never reported its goodput */
+#define RUN_ABORTED   2 /* the station gave up with FATAL, e.g. a bad packet up to the network layer */
+
+static const char *status_names[] = { "ok", "no report", "aborted" };
+
+static struct list bers, modes, seqs, data_timers, ack_timers;
+static char dir[] = "/tmp/sweepXXXXXX";
+
+/* Comma separated values into 'l', replacing the defaults */
+static void split(struct list *l, char *s)
+{
+    char *p;
+
+    l->n = 0;
+    for (p = strtok(s, ","); p && l->n < MAX_LIST; p = strtok(NULL, ","))
+        l->v[l->n++] = p;
+}
+
+static void list_default(struct list *l, const char *s)
+{
+    if (l->n == 0)
+        split(l, strdup(s));
+}
+
+/* Goodput and efficiency of a station: the last line its log reports them on */
+static int parse_log(const char *fname, const char *tag, double *bps, double *eff)
+{
+    char line[512], *p;
+    int status = RUN_NO_REPORT;
+    FILE *f = fopen(fname, "r");
+
+    if (f == NULL)
+        return RUN_NO_REPORT;
+    while (fgets(line, sizeof line, f)) {
+        if (strstr(line, "FATAL: ")) {
+            status = RUN_ABORTED;
+            break;
+        }
+        if (strstr(line, tag) == NULL || (p = strstr(line, "packets received, ")) == NULL)
+            continue;
+        if (sscanf(p + 18, "%lf bps%*[ (,]%lf", bps, eff) == 2)
+            status = RUN_OK;
+    }
+    fclose(f);
+    return status;
+}
+
+static void run_cmd(char *cmd, int size, const struct run *r, int id, int real, int secs, const char *seed)
+{
+    const char *mode = modes.v[r->mode], *ber = bers.v[r->ber];
+    int n;
+
+    n = snprintf(cmd, size, "%s/dl%d %s --ttl=%d -l %s/run%d.log", dir, r->build,
+        real ? "--transport=pair --loop=epoll" : "--sim", secs, dir, id);
+    if (strcmp(mode, "flood") == 0)
+        n += snprintf(cmd + n, size - n, " --flood");
+    else if (strcmp(mode, "ibib") == 0)
+        n += snprintf(cmd + n, size - n, " --ibib");
+    if (atof(ber) == 0)
+        n += snprintf(cmd + n, size - n, " --utopia");
+    else
+        n += snprintf(cmd + n, size - n, " --ber=%s", ber);
+    if (seed && !real)
+        n += snprintf(cmd + n, size - n, " --seed=%s", seed);
+    snprintf(cmd + n, size - n, " >/dev/null 2>&1");
+}
+
+static void run_done(struct run *r, int id, int real)
+{
+    char a[64], b[64];
+
+    /* a pair run logs each station to a file of its own, a simulation both to one */
+    snprintf(a, sizeof a, real ? "%s/run%d-A.log" : "%s/run%d.log", dir, id);
+    snprintf(b, sizeof b, real ? "%s/run%d-B.log" : "%s/run%d.log", dir, id);
+    r->status = parse_log(a, real ? "...." : "Station A:", &r->bps[0], &r->eff[0]);
+    if (r->status == RUN_OK)
+        r->status = parse_log(b, real ? "...." : "Station B:", &r->bps[1], &r->eff[1]);
+    remove(a);
+    remove(b);
+}
+
+/* The record sheet's row for a case, -1 if it does not have it */
+static int ref_row(int mode, int ber)
+{
+    int k;
+
+    for (k = 0; k < (int)(sizeof(refs) / sizeof(refs[0])); k++) {
+        if (strcmp(refs[k].mode, modes.v[mode]) == 0 && refs[k].ber == atof(bers.v[ber]))
+            return k;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    char cmd[512], name[256], *prefix = "sweep", *seed = NULL;
+    int real = 0, secs = 0, jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int nbuild, nrun, i, k, s, d, a, opt, next, done;
+    struct run *runs;
+    FILE **pipes, *csv, *json;
+    int *running;
+
+    while ((opt = getopt(argc, argv, "rt:j:s:o:b:m:w:D:A:")) != -1) {
+        switch (opt) {
+        case 'r': real = 1; break;
+        case 't': secs = atoi(optarg); break;
+        case 'j': jobs = atoi(optarg); break;
+        case 's': seed = optarg; break;
+        case 'o': prefix = optarg; break;
+        case 'b': split(&bers, optarg); break;
+        case 'm': split(&modes, optarg); break;
+        case 'w': split(&seqs, optarg); break;
+        case 'D': split(&data_timers, optarg); break;
+        case 'A': split(&ack_timers, optarg); break;
+        default:
+            printf("Usage: %s [-r] [-t seconds] [-j jobs] [-s seed] [-o prefix] [-b ber,...]\n"
+                "    [-m normal|flood|ibib,...] [-w max_seq,...] [-D data_timer_ms,...] [-A ack_timer_ms,...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    list_default(&bers, "0,1e-5,1e-4");
+    list_default(&modes, "normal,flood,ibib");
+    list_default(&seqs, "7,15,31,63");
+    list_default(&data_timers, "1000,2000,3000");
+    list_default(&ack_timers, "100,300");
+    if (secs <= 0)
+        secs = real ? 60 : 600;
+    if (jobs < 1)
+        jobs = 1;
+
+    if (access("datalink.c", R_OK) != 0 || access("Makefile", R_OK) != 0) {
+        printf("Run from the source directory\n");
+        return 1;
+    }
+    if (mkdtemp(dir) == NULL) {
+        printf("Cannot create a directory for the builds\n");
+        return 1;
+    }
+
+    /* one build per window and timer setting */
+    nbuild = seqs.n * data_timers.n * ack_timers.n;
+    for (i = 0; i < nbuild; i++) {
+        s = i / (data_timers.n * ack_timers.n);
+        d = i / ack_timers.n % data_timers.n;
+        a = i % ack_timers.n;
+        snprintf(cmd, sizeof cmd, "make -s datalink-variant DL_DEFS='-DMAX_SEQ=%s -DDATA_TIMER_MS=%s -DACK_TIMER_MS=%s' "
+            "DL_VARIANT=%s/dl%d", seqs.v[s], data_timers.v[d], ack_timers.v[a], dir, i);
+        if (system(cmd) != 0) {
+            printf("Build failed: %s\n", cmd);
+            return 1;
+        }
+    }
+
+    nrun = nbuild * modes.n * bers.n;
+    runs = (struct run *)calloc(nrun, sizeof(struct run));
+    pipes = (FILE **)calloc(jobs, sizeof(FILE *));
+    running = (int *)calloc(jobs, sizeof(int));
+    if (runs == NULL || pipes == NULL || running == NULL)
+        return 1;
+    for (i = 0; i < nrun; i++) {
+        runs[i].build = i / (modes.n * bers.n);
+        runs[i].mode = i / bers.n % modes.n;
+        runs[i].ber = i % bers.n;
+    }
+
+    printf("%d builds, %d runs of %d s (%s), %d at a time\n", nbuild, nrun, secs,
+        real ? "real time" : "simulated", jobs);
+
+    /* a pool of 'jobs' runs, waited for in the order they were started: they all take about as long */
+    for (next = done = 0; done < nrun; ) {
+        if (next < nrun && next - done < jobs) {
+            run_cmd(cmd, sizeof cmd, &runs[next], next, real, secs, seed);
+            pipes[next % jobs] = popen(cmd, "r");
+            running[next % jobs] = next;
+            next++;
+            continue;
+        }
+        k = done % jobs;
+        if (pipes[k]) {
+            while (fgets(name, sizeof name, pipes[k]))
+                ;
+            pclose(pipes[k]);
+        }
+        run_done(&runs[running[k]], running[k], real);
+        if (++done % 10 == 0 || done == nrun) {
+            printf("\r%d/%d runs", done, nrun);
+            fflush(stdout);
+        }
+    }
+    printf("\n\n");
+
+    snprintf(name, sizeof name, "%s.csv", prefix);
+    csv = fopen(name, "w");
+    snprintf(name, sizeof name, "%s.json", prefix);
+    json = fopen(name, "w");
+    if (csv == NULL || json == NULL) {
+        printf("Cannot write %s.csv/%s.json\n", prefix, prefix);
+        return 1;
+    }
+
+    fprintf(csv, "max_seq,window,data_timer_ms,ack_timer_ms,mode,ber,seconds,status,a_bps,a_eff,b_bps,b_eff,"
+        "ref_sr_a,ref_sr_b,ref_gbn_a,ref_gbn_b\n");
+    fprintf(json, "[\n");
+    printf("%7s %6s %6s %6s %7s %8s %8s  %s\n", "max_seq", "data", "ack", "mode", "ber", "A %", "B %",
+        "selective A/B (sheet)");
+    for (i = 0; i < nrun; i++) {
+        struct run *r = &runs[i];
+        const char *seq = seqs.v[r->build / (data_timers.n * ack_timers.n)];
+        const char *dt = data_timers.v[r->build / ack_timers.n % data_timers.n];
+        const char *at = ack_timers.v[r->build % ack_timers.n];
+
+        k = ref_row(r->mode, r->ber);
+        fprintf(csv, "%s,%d,%s,%s,%s,%s,%d,%s", seq, (atoi(seq) + 1) / 2, dt, at, modes.v[r->mode],
+            bers.v[r->ber], secs, status_names[r->status]);
+        fprintf(json, "%s  {\"max_seq\": %s, \"window\": %d, \"data_timer_ms\": %s, \"ack_timer_ms\": %s, "
+            "\"mode\": \"%s\", \"ber\": %g, \"seconds\": %d, \"status\": \"%s\"", i ? ",\n" : "", seq,
+            (atoi(seq) + 1) / 2, dt, at, modes.v[r->mode], atof(bers.v[r->ber]), secs, status_names[r->status]);
+        printf("%7s %6s %6s %6s %7s ", seq, dt, at, modes.v[r->mode], bers.v[r->ber]);
+
+        if (r->status == RUN_OK) {
+            fprintf(csv, ",%.0f,%.2f,%.0f,%.2f", r->bps[0], r->eff[0], r->bps[1], r->eff[1]);
+            fprintf(json, ", \"a_bps\": %.0f, \"a_eff\": %.2f, \"b_bps\": %.0f, \"b_eff\": %.2f",
+                r->bps[0], r->eff[0], r->bps[1], r->eff[1]);
+            printf("%8.2f %8.2f", r->eff[0], r->eff[1]);
+        } else {
+            fprintf(csv, ",,,,");
+            printf("%17s", status_names[r->status]);
+        }
+
+        if (k >= 0) {
+            fprintf(csv, ",%.1f,%.1f,%.1f,%.1f\n", refs[k].sr_a, refs[k].sr_b, refs[k].gbn_a, refs[k].gbn_b);
+            fprintf(json, ", \"ref_sr_a\": %.1f, \"ref_sr_b\": %.1f, \"ref_gbn_a\": %.1f, \"ref_gbn_b\": %.1f}",
+                refs[k].sr_a, refs[k].sr_b, refs[k].gbn_a, refs[k].gbn_b);
+            printf("  %.1f/%.1f\n", refs[k].sr_a, refs[k].sr_b);
+        } else {
+            fprintf(csv, ",,,,\n");
+            fprintf(json, "}");
+            printf("\n");
+        }
+    }
+    fprintf(json, "\n]\n");
+    fclose(csv);
+    fclose(json);
+    printf("Wrote %s.csv and %s.json\n", prefix, prefix);
+
+    for (i = 0; i < nbuild; i++) {
+        snprintf(name, sizeof name, "%s/dl%d", dir, i);
+        remove(name);
+    }
+    rmdir(dir);
+    return 0;
+}
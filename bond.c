@@ -0,0 +1,176 @@
+/*
+    Bonding (--bond): a station stripes its frames over several channels,
+    each a line of its own, and the receiver puts them back in order.
+*/
+
+#include "phl.h"
+
+/* Line rates of the station's channels, and how long a bonding gap is waited for */
+void bond_rates(void)
+{
+    int i;
+
+    /* a gap may be a frame still on the slowest line: a whole frame's time, and a tick either side */
+    st->chan_bps = 0;
+    for (i = 0; i < st->nchan; i++) {
+        st->chan[i]->bps = mode_rate[i];
+        st->chan_bps += mode_rate[i];
+        if (st->bond_wait_us < (2 * (BOND_HDR + PKT_LEN + 16) + 2) * 4000000LL / mode_rate[i])
+            st->bond_wait_us = (2 * (BOND_HDR + PKT_LEN + 16) + 2) * 4000000LL / mode_rate[i];
+    }
+    st->bond_wait_us += 2 * DEFAULT_TICK * 1000;
+}
+
+/*
+    Bonding: channels past the first are linked once the handshake on the
+    first has agreed on their number and rates.
+*/
+void bond_init(void)
+{
+    int i;
+
+    for (i = 1; i < mode_bond; i++) {
+        ch = (struct CHANNEL *)malloc(sizeof(struct CHANNEL));
+        if (ch == NULL) 
+            ABORT("No enough memory");
+        channel_init(ch, i);
+        st->chan[st->nchan++] = ch;
+
+#ifndef _WIN32
+        if (mode_link == LINK_PAIR)
+            ch->sock = pair_sock[i];
+        else
+#endif
+        if (st->station == 'a')
+            link_accept();
+        else
+            link_connect();
+    }
+
+    bond_rates();
+    ch = st->chan[0];
+}
+
+/*
+    Bonding: every frame leads with its number across all channels, so
+    the receiver can put it back in order, and goes out on the channel
+    that gets it off the line first at the goodput measured so far.
+    Equal channels take turns.
+*/
+struct CHANNEL *bond_pick(int n)
+{
+    struct CHANNEL *best = NULL;
+    double t, best_t = 0.0;
+    int k;
+
+    for (k = 0; k < st->nchan; k++) {
+        ch = st->chan[(st->bond_next_chan + k) % st->nchan];
+        t = (sq_len() + n) * ch->tx_meas_us;
+        if (best == NULL || t < best_t) {
+            best = ch;
+            best_t = t;
+        }
+    }
+    st->bond_next_chan = (best->nr + 1) % st->nchan;
+    return best;
+}
+
+/*
+    Bonding: every channel delivers its frames in the order they were
+    sent, so a frame missing from the numbering while every channel has
+    a later one waiting is lost for good, and the rest can go on. With
+    a channel idle, the gap is given up after bond_wait_us instead. A
+    frame whose number got hit by noise goes up at once, in whatever
+    order: the data link layer copes with that as with any other.
+*/
+static int bond_seq(struct RCV_FRAME *f)
+{
+    if (f->len < BOND_HDR || crc8(f->frame, 2) != f->frame[2])
+        return -1;
+    return f->frame[0] + (f->frame[1] << 8);
+}
+
+/* A frame is in from channel 'ch' */
+void bond_arrive(struct RCV_FRAME *f)
+{
+    int seq = bond_seq(f);
+
+    if (seq >= 0) {
+        if (st->bond_rx_frames && (short)(seq - st->bond_rx_max) < 0)
+            st->bond_reordered++;
+        else
+            st->bond_rx_max = (unsigned short)seq;
+        st->bond_rx_frames++;
+    } else
+        st->bond_hdr_errors++;
+    if (f->off > f->len)
+        f->off = f->len;
+    rf_queue(&ch->bq_head, &ch->bq_tail, f);
+}
+
+/* Move the frames that are next in order, or given up waiting for, up to the data link layer */
+void bond_reorder(void)
+{
+    struct CHANNEL *c, *next;
+    struct RCV_FRAME *f;
+    int i, d, dmin, seq, all_in;
+
+    for (;;) {
+        next = NULL;
+        dmin = 0;
+        all_in = 1;
+        for (i = 0; i < st->nchan; i++) {
+            c = st->chan[i];
+            if (c->bq_head == NULL) {
+                all_in = 0;
+                continue;
+            }
+            seq = bond_seq(c->bq_head);
+            d = seq < 0 ? 0 : (short)(seq - st->bond_rx_seq);
+            /* the next one, a straggler from a gap given up on, or one without a number */
+            if (d <= 0) {
+                next = c;
+                dmin = d;
+                break;
+            }
+            if (next == NULL || d < dmin) {
+                next = c;
+                dmin = d;
+            }
+        }
+        if (next == NULL)
+            return;
+
+        f = next->bq_head;
+        if (dmin > 0) {
+            if (st->bond_gap_us == 0)
+                st->bond_gap_us = st->now_us;
+            if (!all_in && st->now_us - st->bond_gap_us < st->bond_wait_us)
+                return;
+            st->bond_gaps++;
+        }
+        if (dmin >= 0 && bond_seq(f) >= 0) {
+            st->bond_rx_seq = (unsigned short)(bond_seq(f) + 1);
+            st->bond_gap_us = 0;
+        }
+
+        if ((next->bq_head = f->link) == NULL)
+            next->bq_tail = NULL;
+        f->link = NULL;
+        rf_queue(&st->rf_head, &st->rf_tail, f);
+    }
+}
+
+void bond_report(void)
+{
+    int i;
+
+    lprintf("Bonding: %u frames in, %u out of order, %u gaps given up, %u frame numbers hit by noise\n",
+        st->bond_rx_frames, st->bond_reordered, st->bond_gaps, st->bond_hdr_errors);
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        lprintf("Bonding #%d: %d bps line, %u frames sent (%.1f%%), goodput measured %.0f bps\n", ch->nr, ch->bps,
+            ch->tx_frames, st->tx_frames ? 100.0 * ch->tx_frames / st->tx_frames : 0.0, 4000000.0 / ch->tx_meas_us);
+    }
+    ch = st->chan[0];
+}
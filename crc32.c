@@ -5,70 +5,33 @@
         x^8 + x^7 + x^5  + x^4 + x^2 + x + 1
 */
 
-static const unsigned int crc_table[256] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
+#include <string.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "protocol.h"
 
-#define DO1(buf) crc = crc_table[((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
+/* CRC-32, CRC-32C, FCS-16 and CRC-8 tables, generated by mkcrctab at build time */
+#include "crctab.h"
+
+typedef unsigned int (*crc32_kernel)(unsigned int crc, const unsigned char *buf, int len);
+
+#define DO1(buf) crc = crc_table[0][((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
 #define DO2(buf)  DO1(buf); DO1(buf);
 #define DO4(buf)  DO2(buf); DO2(buf);
 #define DO8(buf)  DO4(buf); DO4(buf);
 
-unsigned int crc32(unsigned char *buf, int len)
-{
-    unsigned int crc = 0xffffffffL;
+/* little-endian 32-bit load, folded into a single move by the compiler */
+#define LOAD32(p) ((unsigned int)(p)[0] | (unsigned int)(p)[1] << 8 | \
+                   (unsigned int)(p)[2] << 16 | (unsigned int)(p)[3] << 24)
+
+#define SLICE4(t, w, k) (t[(k) + 3][(w) & 0xff] ^ t[(k) + 2][((w) >> 8) & 0xff] ^ \
+                         t[(k) + 1][((w) >> 16) & 0xff] ^ t[(k)][(w) >> 24])
 
+static unsigned int crc32_byte(unsigned int crc, const unsigned char *buf, int len)
+{
     while (len >= 8) {
         DO8(buf);
         len -= 8;
@@ -83,6 +46,560 @@ unsigned int crc32(unsigned char *buf, int len)
     return crc;
 }
 
+/* Slicing-by-8: 8 table lookups per 8 input bytes, 8 KB of tables */
+static unsigned int crc32_slice8(unsigned int crc, const unsigned char *buf, int len)
+{
+    unsigned int w0, w1;
+
+    while (len >= 8) {
+        w0 = LOAD32(buf) ^ crc;
+        w1 = LOAD32(buf + 4);
+        crc = SLICE4(crc_table, w0, 4) ^ SLICE4(crc_table, w1, 0);
+        buf += 8;
+        len -= 8;
+    }
+
+    return crc32_byte(crc, buf, len);
+}
+
+/* Slicing-by-16: 16 table lookups per 16 input bytes, 16 KB of tables */
+static unsigned int crc32_slice16(unsigned int crc, const unsigned char *buf, int len)
+{
+    unsigned int w0, w1, w2, w3;
+
+    while (len >= 16) {
+        w0 = LOAD32(buf) ^ crc;
+        w1 = LOAD32(buf + 4);
+        w2 = LOAD32(buf + 8);
+        w3 = LOAD32(buf + 12);
+        crc = SLICE4(crc_table, w0, 12) ^ SLICE4(crc_table, w1, 8) ^
+            SLICE4(crc_table, w2, 4) ^ SLICE4(crc_table, w3, 0);
+        buf += 16;
+        len -= 16;
+    }
+
+    return crc32_slice8(crc, buf, len);
+}
+
+/* table engine used for short buffers and tails by the folding engine */
+static crc32_kernel crc32_table_kernel = crc32_slice16;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define CRC_X86
+#define CLMUL_MIN 64 /* shorter buffers go to the table engine */
+
+/* 
+    Folding constants for the reflected polynomial: x^(4*128+32), x^(4*128-32),
+    x^(128+32), x^(128-32) and x^64 mod P, the polynomial P' itself and the 
+    Barrett constant u = floor(x^64 / P), all bit-reflected.
+*/
+static const unsigned long long crc32_k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const unsigned long long crc32_k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const unsigned long long crc32_k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const unsigned long long crc32_poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+
+/* len >= 64 and a multiple of 16 */
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int crc32_clmul_fold(unsigned int crc, const unsigned char *buf, int len)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)crc32_k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold 4 x 128 bits per iteration */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the remaining 128-bit blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction 64 -> 32 bits */
+    x0 = _mm_load_si128((const __m128i *)crc32_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+
+static unsigned int crc32_clmul(unsigned int crc, const unsigned char *buf, int len)
+{
+    int n;
+
+    if (len < CLMUL_MIN)
+        return crc32_table_kernel(crc, buf, len);
+
+    n = len & ~15;
+    crc = crc32_clmul_fold(crc, buf, n);
+    return crc32_table_kernel(crc, buf + n, len - n);
+}
+
+static int crc32_clmul_usable(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#endif /* x86 */
+
+static unsigned int crc32_dispatch(unsigned int crc, const unsigned char *buf, int len);
+
+static const struct {
+    const char *name;
+    crc32_kernel kernel;
+    int (*usable)(void);
+} crc32_engines[] = {
+    { "byte",    crc32_byte, NULL },
+    { "slice8",  crc32_slice8, NULL },
+    { "slice16", crc32_slice16, NULL },
+#ifdef CRC_X86
+    { "clmul",   crc32_clmul, crc32_clmul_usable },
+#endif
+    { NULL, NULL, NULL }
+};
+
+static crc32_kernel crc32_engine_kernel = crc32_dispatch;
+static const char *crc32_engine_name = "auto";
+
+static void crc32_select(void);
+
+int crc32_set_engine(const char *name)
+{
+    int i;
+
+    if (strcmp(name, "auto") == 0) {
+        crc32_select();
+        return 1;
+    }
+
+    for (i = 0; crc32_engines[i].name; i++) {
+        if (strcmp(crc32_engines[i].name, name) == 0) {
+            if (crc32_engines[i].usable && !crc32_engines[i].usable())
+                return 0;
+            crc32_engine_kernel = crc32_engines[i].kernel;
+            crc32_engine_name = crc32_engines[i].name;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *crc32_engine(void)
+{
+    return crc32_engine_name;
+}
+
+/* 
+    Pick an engine: $CRC32_ENGINE if it names one, otherwise
+    the PCLMULQDQ folding engine when the CPU has it. The table engine (also
+    used by the folding engine below CLMUL_MIN bytes) is slicing-by-16 when 
+    its 16 KB of tables fit comfortably in L1, slicing-by-8 on smaller caches.
+    fcs_select() does so before any thread starts; a program that never
+    calls it gets the engine picked on first use instead.
+*/
+static void crc32_select(void)
+{
+    const char *env = getenv("CRC32_ENGINE");
+    long l1 = 0;
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+#endif
+    crc32_table_kernel = l1 > 0 && l1 < 32 * 1024 ? crc32_slice8 : crc32_slice16;
+
+    if (env && strcmp(env, "auto") != 0 && crc32_set_engine(env))
+        return;
+    if (crc32_set_engine("clmul"))
+        return;
+    crc32_set_engine(crc32_table_kernel == crc32_slice8 ? "slice8" : "slice16");
+}
+
+static unsigned int crc32_dispatch(unsigned int crc, const unsigned char *buf, int len)
+{
+    crc32_select();
+    return crc32_engine_kernel(crc, buf, len);
+}
+
+unsigned int crc32(unsigned char *buf, int len)
+{
+    return crc32_engine_kernel(0xffffffffL, buf, len);
+}
+
+/* 
+    Incremental interface. Like crc32(), the result is the raw register
+    (no final complement), so crc32_final() is the identity and appending
+    it little-endian still yields a zero remainder.
+*/
+unsigned int crc32_init(void)
+{
+    return 0xffffffffL;
+}
+
+unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len)
+{
+    return crc32_engine_kernel(crc, buf, len);
+}
+
+unsigned int crc32_final(unsigned int crc)
+{
+    return crc;
+}
+
+/* a(x) * b(x) mod P, reflected, for a 'width'-bit register */
+static unsigned int multmodp(unsigned int a, unsigned int b, unsigned int poly, int width)
+{
+    unsigned int m = 1U << (width - 1), p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) mod P */
+static unsigned int x2nmodp(unsigned int n, unsigned int k, const unsigned int *x2n, unsigned int poly, int width)
+{
+    unsigned int p = 1U << (width - 1); /* x^0 */
+
+    while (n) {
+        if (n & 1)
+            p = multmodp(x2n[k & 31], p, poly, width);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* 
+    Shifting a register over 'len' zero bytes is linear, so it is applied
+    with byte-indexed tables. Callers combine with the same length over 
+    and over (the payload length): fcs_select() builds the tables for
+    PKT_LEN once, before any thread runs, and they are only read after
+    that. Any other length is shifted without tables.
+*/
+struct crc_shift {
+    unsigned int poly;
+    int width;
+    const unsigned int *x2n;
+    int len;
+    unsigned int shift[4][256];
+};
+
+static struct crc_shift crc32_shift = { 0xedb88320L, 32, crc_x2n_table, -1, { { 0 } } };
+static struct crc_shift crc32c_shift = { 0x82f63b78L, 32, crc32c_x2n_table, -1, { { 0 } } };
+static struct crc_shift fcs16_shift = { 0x8408, 16, fcs16_x2n_table, -1, { { 0 } } };
+
+static void crc_shift_prepare(struct crc_shift *c, int len)
+{
+    unsigned int op = x2nmodp((unsigned int)len, 3, c->x2n, c->poly, c->width), b, j, bit;
+
+    for (j = 0; j < (unsigned int)c->width / 8; j++) {
+        c->shift[j][0] = 0;
+        for (b = 1; b < 256; b++) {
+            bit = b & -b;
+            c->shift[j][b] = b == bit ? multmodp(op, bit << (8 * j), c->poly, c->width) :
+                c->shift[j][b ^ bit] ^ c->shift[j][bit];
+        }
+    }
+    c->len = len;
+}
+
+/* register after A then B, from the register after A and B's own register (both from 'init') */
+static unsigned int crc_combine(const struct crc_shift *c, unsigned int init, unsigned int crcA, unsigned int crcB,
+    int lenB)
+{
+    unsigned int x = crcA ^ init;
+
+    if (lenB <= 0)
+        return crcA;
+    if (lenB != c->len)
+        return crcB ^ multmodp(x2nmodp((unsigned int)lenB, 3, c->x2n, c->poly, c->width), x, c->poly, c->width);
+
+    return crcB ^ c->shift[0][x & 0xff] ^ c->shift[1][(x >> 8) & 0xff] ^
+        c->shift[2][(x >> 16) & 0xff] ^ c->shift[3][x >> 24];
+}
+
+unsigned int crc32_combine(unsigned int crcA, unsigned int crcB, int lenB)
+{
+    return crc_combine(&crc32_shift, 0xffffffffL, crcA, crcB, lenB);
+}
+
+/* CRC-32C (Castagnoli) */
+
+static unsigned int crc32c_slice8(unsigned int crc, const unsigned char *buf, int len)
+{
+    unsigned int w0, w1;
+
+    while (len >= 8) {
+        w0 = LOAD32(buf) ^ crc;
+        w1 = LOAD32(buf + 4);
+        crc = SLICE4(crc32c_table, w0, 4) ^ SLICE4(crc32c_table, w1, 0);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef CRC_X86
+
+/* SSE4.2 crc32 instruction, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *buf, int len)
+{
+#ifdef __x86_64__
+    unsigned long long c = crc, w;
+
+    while (len >= 8) {
+        memcpy(&w, buf, 8);
+        c = _mm_crc32_u64(c, w);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (unsigned int)c;
+#endif
+
+    while (len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+
+    return crc;
+}
+
+#endif
+
+static unsigned int crc32c_dispatch(unsigned int crc, const unsigned char *buf, int len);
+
+static crc32_kernel crc32c_kernel = crc32c_dispatch;
+
+static void crc32c_select(void)
+{
+    crc32c_kernel = crc32c_slice8;
+#ifdef CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_kernel = crc32c_sse42;
+#endif
+}
+
+static unsigned int crc32c_dispatch(unsigned int crc, const unsigned char *buf, int len)
+{
+    crc32c_select();
+    return crc32c_kernel(crc, buf, len);
+}
+
+/* RFC 1662 FCS-16 */
+
+static unsigned int fcs16_byte(unsigned int fcs, const unsigned char *buf, int len)
+{
+    while (len--)
+        fcs = (fcs >> 8) ^ fcs16_table[0][(fcs ^ *buf++) & 0xff];
+
+    return fcs;
+}
+
+unsigned int crc16(unsigned char *buf, int len)
+{
+    return fcs16_byte(0xffff, buf, len) ^ 0xffff;
+}
+
+unsigned int crc8(unsigned char *buf, int len)
+{
+    unsigned int crc = 0xff;
+
+    while (len--)
+        crc = crc8_table[0][(crc ^ *buf++) & 0xff];
+
+    return crc;
+}
+
+/* 
+    Frame Check Sequence
+
+    Every FCS is a reflected CRC with an all-ones initial register, sent
+    least significant byte first. The registers handed out by fcs_update()
+    are before the final complement, so they combine like crc32_combine()
+    and a good frame leaves a fixed residue in the register.
+*/
+
+static unsigned int fcs_crc32_update(unsigned int reg, const unsigned char *buf, int len)
+{
+    return crc32_engine_kernel(reg, buf, len);
+}
+
+static unsigned int fcs_crc32c_update(unsigned int reg, const unsigned char *buf, int len)
+{
+    return crc32c_kernel(reg, buf, len);
+}
+
+static const struct {
+    const char *name;
+    int len;
+    unsigned int init, xorout, residue;
+    crc32_kernel update;
+    struct crc_shift *shift;
+} fcs_models[] = {
+    { "crc32",  4, 0xffffffffL, 0,           0,           fcs_crc32_update,  &crc32_shift },
+    { "crc32c", 4, 0xffffffffL, 0xffffffffL, 0xb798b438L, fcs_crc32c_update, &crc32c_shift },
+    { "fcs16",  2, 0xffff,      0xffff,      0xf0b8,      fcs16_byte,        &fcs16_shift },
+    { "fcs32",  4, 0xffffffffL, 0xffffffffL, 0xdebb20e3L, fcs_crc32_update,  &crc32_shift },
+};
+
+static int fcs_current = FCS_CRC32;
+
+int fcs_select(int type)
+{
+    if (type < 0 || type >= (int)(sizeof(fcs_models) / sizeof(fcs_models[0])))
+        return 0;
+    fcs_current = type;
+    if (crc32_engine_kernel == crc32_dispatch)
+        crc32_select();
+    if (crc32c_kernel == crc32c_dispatch)
+        crc32c_select();
+    if (fcs_models[type].shift->len != PKT_LEN)
+        crc_shift_prepare(fcs_models[type].shift, PKT_LEN);
+    return 1;
+}
+
+int fcs_type(void)
+{
+    return fcs_current;
+}
+
+const char *fcs_name(int type)
+{
+    if (type < 0 || type >= (int)(sizeof(fcs_models) / sizeof(fcs_models[0])))
+        return "none";
+    return fcs_models[type].name;
+}
+
+int fcs_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(fcs_models) / sizeof(fcs_models[0])); i++) {
+        if (strcmp(fcs_models[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int fcs_len(void)
+{
+    return fcs_models[fcs_current].len;
+}
+
+unsigned int fcs_init(void)
+{
+    return fcs_models[fcs_current].init;
+}
+
+unsigned int fcs_update(unsigned int reg, unsigned char *buf, int len)
+{
+    return fcs_models[fcs_current].update(reg, buf, len);
+}
+
+unsigned int fcs_combine(unsigned int regA, unsigned int regB, int lenB)
+{
+    return crc_combine(fcs_models[fcs_current].shift, fcs_models[fcs_current].init, regA, regB, lenB);
+}
+
+int fcs_put(unsigned char *frame, int len, unsigned int reg)
+{
+    int i;
+
+    reg ^= fcs_models[fcs_current].xorout;
+    for (i = 0; i < fcs_models[fcs_current].len; i++, reg >>= 8)
+        frame[len + i] = (unsigned char)reg;
+
+    return len + fcs_models[fcs_current].len;
+}
+
+int fcs_append(unsigned char *frame, int len)
+{
+    return fcs_put(frame, len, fcs_update(fcs_init(), frame, len));
+}
+
+int fcs_check(unsigned char *frame, int len)
+{
+    if (len < fcs_models[fcs_current].len)
+        return 0;
+    return fcs_good(fcs_update(fcs_init(), frame, len));
+}
+
+int fcs_good(unsigned int reg)
+{
+    return reg == fcs_models[fcs_current].residue;
+}
+
 #if 0
 
 #include <stdio.h>
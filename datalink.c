@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "protocol.h"
@@ -16,6 +17,7 @@ typedef unsigned char bool;
 
 //Frame Structure
 typedef struct{
+    uint8 hcs;//Header Check, only on the line in cut-through mode
     uint8 kind;//Type of the Frame
     uint8 ack;//Piggybacking
     uint8 seq;//Sequence Number
@@ -27,204 +29,307 @@ typedef FRAME* FRAME_ITER;
 //DIY Constance
 static const bool TRUE = 1;
 static const bool FALSE = 0;
-static const int32 DATA_TIMER = 2000; //超时时间2000ms
-static const int32 ACK_TIMER = 300; //超时时间300ms
+//Timers and window may be set at build time, e.g. -DMAX_SEQ=15 (bench/sweep_bench does)
+#ifndef DATA_TIMER_MS
+#define DATA_TIMER_MS 2000
+#endif
+#ifndef ACK_TIMER_MS
+#define ACK_TIMER_MS 300
+#endif
+#ifndef MAX_SEQ
+#define MAX_SEQ 63
+#endif
+#if MAX_SEQ < 1 || MAX_SEQ > 127 || ((MAX_SEQ + 1) & MAX_SEQ)
+#error "MAX_SEQ + 1 must be a power of 2, up to 128"
+#endif
+static const int32 DATA_TIMER = DATA_TIMER_MS; //超时时间2000ms
+static const int32 ACK_TIMER = ACK_TIMER_MS; //超时时间300ms
 static const int32 TRAN_TIME = 1000*sizeof(FRAME)/8000;
 //static const uint8 NAK_INTERVAL = 4;
 static const int32 PROP_DELAY = 270;//270ms
-#define MAX_SEQ 63
 #define SEQ_MOD (MAX_SEQ + 1)
 #define WINDOW_SIZE ((MAX_SEQ + 1) >> 1)
+#define CTRL_LEN 4 //Compact ACK/NAK: KIND|FLAGS, ACK, FCS-16
+
 
 
+//Link State, one per station run by this process, zeroed by protocol_run()
+typedef struct{
+    uint8 cnt_buffered;
+    byte buffer[PKT_LEN];
+    bool phl_ready;
+    bool cut_through;
+    int32 hdr_len;//KIND, ACK, SEQ, plus HCS in front of them in cut-through mode
+
+    //Sender window statistics
+    uint32 stall_cnt, stall_ms, stall_since;
 
-//Global Variables
-static uint8 cnt_buffered;
-static byte buffer[PKT_LEN];
-static bool phl_ready = FALSE;
+    //Sliding Window Protocol 
+    FRAME recv_window[WINDOW_SIZE],post_window[WINDOW_SIZE];
+    uint32 post_fcs[WINDOW_SIZE];//FCS register of each post_window payload, reused by every retransmission
+    bool recv_arrived[WINDOW_SIZE],post_arrived[WINDOW_SIZE];
+    uint8 nak_counter[WINDOW_SIZE];
+    uint8 frame_except_new;
+    uint8 recv_front;//Lower Edge of Receiver
+    uint8 recv_tail;
+    uint8 oldest_frame_id;
+    uint8 next_frame_id;
 
-//Sliding Window Protocol 
-static FRAME recv_window[WINDOW_SIZE],post_window[WINDOW_SIZE];
-static bool recv_arrived[WINDOW_SIZE],post_arrived[WINDOW_SIZE];
-static uint8 nak_counter[WINDOW_SIZE];
-static uint8 frame_except_new = 0;
-static uint8 recv_front = 0;//Lower Edge of Receiver
-static uint8 recv_tail = WINDOW_SIZE;
-static uint8 oldest_frame_id = 0;
-static uint8 next_frame_id = 0;
+    uint8 ack_sequence[SEQ_MOD];
+    uint8 ack_sequence_front;
+    uint8 ack_sequence_tail; 
+}LINK;
 
-static uint8 ack_sequence[SEQ_MOD];
-static uint8 ack_sequence_front = 0;
-static uint8 ack_sequence_tail = 0; 
+//The link stall_report() tells about, a single station only
+static LINK *stall_link;
 
 
 static bool within_range(uint8 l,uint8 r,uint8 val);
-static uint8 recv_window_slide();
-static bool is_recv_waiting(uint8 seq);
+static uint8 recv_window_slide(LINK *l);
+static bool is_recv_waiting(LINK *l, uint8 seq);
 
-static void post_window_push(byte *buf,int32 len);
-static bool is_post_window_exist(uint8 seq);
+static void post_window_push(LINK *l, byte *buf,int32 len);
+static bool is_post_window_exist(LINK *l, uint8 seq);
 
-static uint8 pop_oldest_ack_seq();
-static void push_ack_seq(uint8 seq);
-static bool is_ack_seq_empty();
+static uint8 pop_oldest_ack_seq(LINK *l);
+static void push_ack_seq(LINK *l, uint8 seq);
+static bool is_ack_seq_empty(LINK *l);
 
 //Send data frame
-static void send_data_frame(uint8 seq);
-//Add CRC code
-static void put_frame(byte *frame, int len);
+static void send_data_frame(LINK *l, uint8 seq);
+//Add a precomputed FCS register
+static void put_frame_fcs(LINK *l, byte *frame, int len, uint32 reg);
 //Send ACK frame
-static void send_ack_frame(uint8 seq);
+static void send_ack_frame(LINK *l, uint8 seq);
 //Send NAK frame
-static void send_nak_frame(uint8 seq);
+static void send_nak_frame(LINK *l, uint8 seq);
+//Send a compact ACK/NAK frame
+static void put_ctrl_frame(LINK *l, uint8 kind, uint8 seq);
+//Check a compact ACK/NAK frame
+static bool is_ctrl_frame_good(byte *frame, int32 len);
 //Choice which NAK to send
-static void choice_nak_to_send();
+static void choice_nak_to_send(LINK *l);
+//Handle a frame that passed its check, still in the physical layer's buffer
+static void recv_good_frame(LINK *l, const byte *frame, int32 len);
+//Handle an ACK, piggybacked or not
+static void recv_ack(LINK *l, uint8 ack);
+//First byte of the frame on the line
+static byte *frame_start(LINK *l, FRAME_ITER f);
+//Sender window stall accounting
+static void stall_account(LINK *l);
+static void stall_report();
+//Start of a station
+static void link_init(void *ctx);
+//One event of a station
+static void link_event(void *ctx, int event, int arg);
 int main(int argc, char **argv){
     
-    protocol_init(argc,argv);
+    protocol_run(argc, argv, sizeof(LINK), link_init, link_event);
+    
+    return 0;
+}
+static void link_init(void *ctx){
+    LINK *l = (LINK *)ctx;
+
     lprintf("Designed by RowletQwQ, build: "__DATE__" "__TIME__"\n");
     
+    l->hdr_len = 3;
+    l->recv_tail = WINDOW_SIZE;
+    //Cut-through: DATA frames lead with a CRC-8 over KIND, ACK, SEQ
+    if(phl_cut_through(4)){
+        l->cut_through = TRUE;
+        l->hdr_len = 4;
+    }
+    //With --links or --sim protocol.c sums up all the links itself
+    if(phl_links() == 0){
+        stall_link = l;
+        atexit(stall_report);
+    }
+
     disable_network_layer();
-    int32 event, arg;
-    int32 len = 0;
-    FRAME f;
-    memset(recv_arrived,0,sizeof(recv_arrived));
-    memset(post_arrived,0,sizeof(post_arrived));
-    memset(nak_counter,0,sizeof(nak_counter));
-    for (;;){
-        event = wait_for_event(&arg);
-        switch(event){
-            case NETWORK_LAYER_READY:
-                //Get the packet, then push it into the post window, waiting for ACK
-                get_packet(buffer);
-                post_window_push(buffer,PKT_LEN);
-                ++cnt_buffered;
-                send_data_frame(next_frame_id);
-                next_frame_id = (next_frame_id + 1) % (MAX_SEQ + 1);
-                dbg_frame("Post Buffered Count %d,Next_Frame_Id %d\n",cnt_buffered,next_frame_id);
-                break;
-            
-            case PHYSICAL_LAYER_READY:
-                phl_ready = TRUE;
-                break;
+}
+static void link_event(void *ctx, int event, int arg){
+    LINK *l = (LINK *)ctx;
+    int32 len = 0, good;
+    byte *frame;
+    byte hdr[4];
 
-            case FRAME_RECEIVED:
-                len = recv_frame((unsigned char *)&f, sizeof f);
-                if (len < 5 || crc32((unsigned char *)&f, len) != 0) {
-                    dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-                    
-                    //When accept an error Frame,Send Least Resend Frame
-                    choice_nak_to_send();
-                    break;
-                }
-                if(f.kind == FRAME_NAK){
-                    dbg_frame("Recv NAK  %d\n", f.ack);
-                    if(is_post_window_exist(f.ack) && get_timer(f.ack) < DATA_TIMER - TRAN_TIME - PROP_DELAY*2){
-                        dbg_frame("Resend DATA %d, ID %d\n", f.ack, *(short *)post_window[f.ack%WINDOW_SIZE].data);
-                        send_data_frame(f.ack);
-                    }else{
-                        dbg_frame("NAK %d is out of date\n",f.ack);
-                    }
-                    break;
-                }
-                if (f.kind == FRAME_ACK){
-                    dbg_frame("Recv ACK  %d\n", f.ack);
-                } 
-                if (f.kind == FRAME_DATA) {
-                    dbg_frame("Recv DATA %d, Piggybacking ACK %d, ID %d\n", f.seq, f.ack, *(short *)f.data);
-                    push_ack_seq(f.seq);
-                    start_ack_timer(ACK_TIMER);//Start Timer for ACK, Piggybacking or Sending single ACK Frame
-                    
-                    if(is_recv_waiting(f.seq) && !recv_arrived[f.seq%WINDOW_SIZE]){
-                        //Update frame_except_new to the newest possible Frame
-                        if(frame_except_new == f.seq){
-                            frame_except_new = (frame_except_new + 1) % (MAX_SEQ + 1);
-                            if(!is_recv_waiting(frame_except_new)){
-                                frame_except_new = f.seq;
-                            }
-                        }
-                        //frame_except_new = f.seq;
-                        dbg_frame("Confirm DATA %d, ID %d, Frame Excepted %d, Tail %d\n",f.seq,*(short *)f.data,recv_front,recv_tail);
-                        recv_arrived[f.seq%WINDOW_SIZE] = TRUE;
-                        recv_window[f.seq%WINDOW_SIZE] = f;
-                        nak_counter[f.seq%WINDOW_SIZE] = 0;
-                        
-                        while(recv_arrived[recv_front%WINDOW_SIZE] == TRUE){
-                            //Sliding the recv window, and update frame_except_new
-                            recv_arrived[recv_front%WINDOW_SIZE] = FALSE;
-                            dbg_frame("Recv Window:Frame Excepted %d, Tail %d\n",recv_front,recv_tail);
-                            FRAME_ITER buf = &recv_window[recv_window_slide()];
-                            frame_except_new = recv_front;
-                            dbg_frame("Sending DATA %d to Network Layer,ID %d\n",buf->seq,*(short *)buf->data);
-                            put_packet(buf->data,len - 7);
-                            
-                        }
-                        
-                    }
-                } 
-                if(is_post_window_exist(f.ack)){
-                    //收到ACK,确认是否需要滑动发送窗口
-                    dbg_frame("Correct ACK, Oldest Frame ID %d, Next Frame ID %d, Now ID %d\n",oldest_frame_id,next_frame_id,f.ack);
-                    dbg_frame("Stop Timer %d\n",f.ack%WINDOW_SIZE);
-                    
-                    stop_timer(f.ack);
-                    post_arrived[f.ack%WINDOW_SIZE] = TRUE;
-                    //push_ack_seq(f.ack);
-                    while(post_arrived[oldest_frame_id%WINDOW_SIZE]&&oldest_frame_id != next_frame_id){
-                        post_arrived[oldest_frame_id%WINDOW_SIZE] = FALSE;
-                        --cnt_buffered;//此处减小规模
-                        oldest_frame_id = (oldest_frame_id + 1) % (MAX_SEQ + 1);
-                    }
-
-                    dbg_frame("Post Buffered Count %d,Oldest_Frame_Id %d\n",cnt_buffered,oldest_frame_id);
-                    
-                }else{
-                    dbg_frame("Bad ACK, Oldest Frame ID %d, Next Frame ID %d, Now ID %d\n",oldest_frame_id,next_frame_id,f.ack);
-                }
-                break;
+    switch(event){
+        case NETWORK_LAYER_READY:
+            //Get the packet, then push it into the post window, waiting for ACK
+            get_packet(l->buffer);
+            post_window_push(l, l->buffer,PKT_LEN);
+            ++l->cnt_buffered;
+            send_data_frame(l, l->next_frame_id);
+            l->next_frame_id = (l->next_frame_id + 1) % (MAX_SEQ + 1);
+            dbg_frame("Post Buffered Count %d,Next_Frame_Id %d\n",l->cnt_buffered,l->next_frame_id);
+            break;
+        
+        case PHYSICAL_LAYER_READY:
+            l->phl_ready = TRUE;
+            break;
 
-            case DATA_TIMEOUT:
-                dbg_event("---- DATA %d timeout\n", arg);
-                dbg_frame("Resend DATA %d\n", arg);
-                send_data_frame(arg);
-                break;
+        case FRAME_HEADER:
+            //Cut-through: act on the piggybacked ACK before the payload is in
+            recv_frame_header(hdr, sizeof hdr);
+            if(hdr[1] == FRAME_DATA && hdr[0] == crc8(hdr + 1, 3)){
+                dbg_frame("Recv DATA header %d, Piggybacking ACK %d\n", hdr[3], hdr[2]);
+                recv_ack(l, hdr[2]);
+            }
+            break;
 
-            case ACK_TIMEOUT:
-                dbg_frame("ACK timeout\n");
-                while(!is_ack_seq_empty()){
-                    uint8 ack_num = pop_oldest_ack_seq();
-                    send_ack_frame(ack_num);
-                }
+        case FRAME_RECEIVED:
+            //The physical layer checked the FCS while reassembling the frame, parse it where it lies
+            good = recv_frame_peek(&frame, &len);
+            if (len == CTRL_LEN ? !is_ctrl_frame_good(frame, len) :
+                len < l->hdr_len + fcs_len() || len > l->hdr_len + PKT_LEN + fcs_len() || !good) {
+                recv_frame_release();
+                dbg_event("**** Receiver Error, Bad CRC Checksum\n");
+                
+                //When accept an error Frame,Send Least Resend Frame
+                choice_nak_to_send(l);
                 break;
-        }
+            }
+            recv_good_frame(l, frame, len);
+            recv_frame_release();
+            break;
 
-        if(cnt_buffered < WINDOW_SIZE && phl_ready){
-            enable_network_layer();
-        }else{
-            disable_network_layer();
-        }
+        case DATA_TIMEOUT:
+            dbg_event("---- DATA %d timeout\n", arg);
+            dbg_frame("Resend DATA %d\n", arg);
+            send_data_frame(l, arg);
+            break;
+
+        case ACK_TIMEOUT:
+            dbg_frame("ACK timeout\n");
+            while(!is_ack_seq_empty(l)){
+                uint8 ack_num = pop_oldest_ack_seq(l);
+                send_ack_frame(l, ack_num);
+            }
+            break;
+    }
+
+    stall_account(l);
+    if(l->cnt_buffered < WINDOW_SIZE && l->phl_ready){
+        enable_network_layer();
+    }else{
+        disable_network_layer();
     }
-    
-    return 0;
 }
-static void choice_nak_to_send(){
+static void choice_nak_to_send(LINK *l){
     uint8 least_resend_frame = 0xff;
     uint8 least_resend_frame_cnt = 0xff;
     //From recv_front forward to frame_except_new,get the frame do not received
-    for(uint8 i = recv_front; i != frame_except_new ; i = (i + 1) % (MAX_SEQ + 1)){
-        if(!recv_arrived[i%WINDOW_SIZE] && nak_counter[i%WINDOW_SIZE] < least_resend_frame_cnt){
-            least_resend_frame_cnt = nak_counter[i%WINDOW_SIZE];
+    for(uint8 i = l->recv_front; i != l->frame_except_new ; i = (i + 1) % (MAX_SEQ + 1)){
+        if(!l->recv_arrived[i%WINDOW_SIZE] && l->nak_counter[i%WINDOW_SIZE] < least_resend_frame_cnt){
+            least_resend_frame_cnt = l->nak_counter[i%WINDOW_SIZE];
             least_resend_frame = i;
         }
     }
-    if(!recv_arrived[frame_except_new%WINDOW_SIZE] && nak_counter[frame_except_new%WINDOW_SIZE] < least_resend_frame_cnt ){
-        least_resend_frame = frame_except_new;
-        least_resend_frame_cnt = nak_counter[frame_except_new];
+    if(!l->recv_arrived[l->frame_except_new%WINDOW_SIZE] && l->nak_counter[l->frame_except_new%WINDOW_SIZE] < least_resend_frame_cnt ){
+        least_resend_frame = l->frame_except_new;
+        least_resend_frame_cnt = l->nak_counter[l->frame_except_new];
     }
-    nak_counter[least_resend_frame%WINDOW_SIZE]++;
-    dbg_frame("Least Resend Frame %d, ID %d, Count %d\n",least_resend_frame,*(short *)recv_window[least_resend_frame%WINDOW_SIZE].data,
-    nak_counter[least_resend_frame%WINDOW_SIZE]);
-    send_nak_frame(least_resend_frame);
+    l->nak_counter[least_resend_frame%WINDOW_SIZE]++;
+    dbg_frame("Least Resend Frame %d, ID %d, Count %d\n",least_resend_frame,*(short *)l->recv_window[least_resend_frame%WINDOW_SIZE].data,
+    l->nak_counter[least_resend_frame%WINDOW_SIZE]);
+    send_nak_frame(l, least_resend_frame);
+}
+
+static void recv_good_frame(LINK *l, const byte *frame, int32 len){
+    //KIND, ACK, SEQ follow the HCS in cut-through mode; ACK/NAK frames carry KIND and ACK only
+    const byte *h = len == CTRL_LEN ? frame : frame + l->hdr_len - 3;
+    const byte *data = h + 3;
+    uint8 kind = h[0] & FRAME_KIND_MASK, ack = h[1], seq = len == CTRL_LEN ? 0 : h[2];
+
+    if(kind == FRAME_NAK){
+        dbg_frame("Recv NAK  %d\n", ack);
+        if(is_post_window_exist(l, ack) && get_timer(ack) < DATA_TIMER - TRAN_TIME - PROP_DELAY*2){
+            dbg_frame("Resend DATA %d, ID %d\n", ack, *(short *)l->post_window[ack%WINDOW_SIZE].data);
+            send_data_frame(l, ack);
+        }else{
+            dbg_frame("NAK %d is out of date\n",ack);
+        }
+        return;
+    }
+    if (kind == FRAME_ACK){
+        dbg_frame("Recv ACK  %d\n", ack);
+    } 
+    if (kind == FRAME_DATA) {
+        dbg_frame("Recv DATA %d, Piggybacking ACK %d, ID %d\n", seq, ack, *(short *)data);
+        push_ack_seq(l, seq);
+        start_ack_timer(ACK_TIMER);//Start Timer for ACK, Piggybacking or Sending single ACK Frame
+        
+        if(is_recv_waiting(l, seq) && !l->recv_arrived[seq%WINDOW_SIZE]){
+            //Update frame_except_new to the newest possible Frame
+            if(l->frame_except_new == seq){
+                l->frame_except_new = (l->frame_except_new + 1) % (MAX_SEQ + 1);
+                if(!is_recv_waiting(l, l->frame_except_new)){
+                    l->frame_except_new = seq;
+                }
+            }
+            //frame_except_new = seq;
+            dbg_frame("Confirm DATA %d, ID %d, Frame Excepted %d, Tail %d\n",seq,*(short *)data,l->recv_front,l->recv_tail);
+            l->recv_arrived[seq%WINDOW_SIZE] = TRUE;
+            //Only accepted frames are copied out, duplicates and bad frames never are
+            FRAME_ITER slot = &l->recv_window[seq%WINDOW_SIZE];
+            slot->kind = kind;
+            slot->ack = ack;
+            slot->seq = seq;
+            memcpy(slot->data, data, len - l->hdr_len - fcs_len());
+            l->nak_counter[seq%WINDOW_SIZE] = 0;
+            
+            while(l->recv_arrived[l->recv_front%WINDOW_SIZE] == TRUE){
+                //Sliding the recv window, and update frame_except_new
+                l->recv_arrived[l->recv_front%WINDOW_SIZE] = FALSE;
+                dbg_frame("Recv Window:Frame Excepted %d, Tail %d\n",l->recv_front,l->recv_tail);
+                FRAME_ITER buf = &l->recv_window[recv_window_slide(l)];
+                l->frame_except_new = l->recv_front;
+                dbg_frame("Sending DATA %d to Network Layer,ID %d\n",buf->seq,*(short *)buf->data);
+                put_packet(buf->data,len - l->hdr_len - fcs_len());
+                
+            }
+            
+        }
+    } 
+    recv_ack(l, ack);
+}
+static void recv_ack(LINK *l, uint8 ack){
+    if(is_post_window_exist(l, ack)){
+        //收到ACK,确认是否需要滑动发送窗口
+        dbg_frame("Correct ACK, Oldest Frame ID %d, Next Frame ID %d, Now ID %d\n",l->oldest_frame_id,l->next_frame_id,ack);
+        dbg_frame("Stop Timer %d\n",ack%WINDOW_SIZE);
+        
+        stop_timer(ack);
+        l->post_arrived[ack%WINDOW_SIZE] = TRUE;
+        while(l->post_arrived[l->oldest_frame_id%WINDOW_SIZE]&&l->oldest_frame_id != l->next_frame_id){
+            l->post_arrived[l->oldest_frame_id%WINDOW_SIZE] = FALSE;
+            --l->cnt_buffered;//此处减小规模
+            l->oldest_frame_id = (l->oldest_frame_id + 1) % (MAX_SEQ + 1);
+        }
+
+        dbg_frame("Post Buffered Count %d,Oldest_Frame_Id %d\n",l->cnt_buffered,l->oldest_frame_id);
+        
+    }else{
+        dbg_frame("Bad ACK, Oldest Frame ID %d, Next Frame ID %d, Now ID %d\n",l->oldest_frame_id,l->next_frame_id,ack);
+    }
+}
+static byte *frame_start(LINK *l, FRAME_ITER f){
+    return l->cut_through ? &f->hcs : &f->kind;
+}
+static void stall_account(LINK *l){
+    if(l->cnt_buffered >= WINDOW_SIZE){
+        if(l->stall_since == 0){
+            l->stall_since = get_ms() | 1;
+            ++l->stall_cnt;
+        }
+    }else if(l->stall_since){
+        l->stall_ms += get_ms() - l->stall_since;
+        l->stall_since = 0;
+    }
+}
+static void stall_report(){
+    lprintf("Sender window stalled %u times, %u ms in total\n", stall_link->stall_cnt, stall_link->stall_ms);
 }
 
 static bool within_range(uint8 l,uint8 r,uint8 val){
@@ -234,96 +339,114 @@ static bool within_range(uint8 l,uint8 r,uint8 val){
     }
     return (l <= val) || (val < r);
 }
-static bool is_recv_waiting(uint8 seq){
+static bool is_recv_waiting(LINK *l, uint8 seq){
     if(seq > MAX_SEQ){
         //dbg_event("***is_recv_waiting:Bad Sequence Number, Except No More Than %u, But Get %u\n",MAX_SEQ,seq);
         return FALSE;
     }
-    if(recv_front == recv_tail){
+    if(l->recv_front == l->recv_tail){
         //Empty
         return FALSE;
     }
-    return within_range(recv_front,recv_tail,seq);
+    return within_range(l->recv_front,l->recv_tail,seq);
 }
-static bool is_post_window_exist(uint8 seq){
+static bool is_post_window_exist(LINK *l, uint8 seq){
     if(seq > MAX_SEQ){
         //dbg_event("***is_post_window_exist:Bad Sequence Number, Except No More Than %u, But Get %u\n",MAX_SEQ,seq);
         return FALSE;
     }
-    if(oldest_frame_id == next_frame_id){
+    if(l->oldest_frame_id == l->next_frame_id){
         return FALSE;
     }
-    return within_range(oldest_frame_id,next_frame_id,seq);
+    return within_range(l->oldest_frame_id,l->next_frame_id,seq);
 }
-static uint8 recv_window_slide(){
-    uint8 ret = recv_front%WINDOW_SIZE;
+static uint8 recv_window_slide(LINK *l){
+    uint8 ret = l->recv_front%WINDOW_SIZE;
     //FRAME ret = recv_window[recv_front%WINDOW_SIZE];
-    recv_front = (recv_front + 1) % (MAX_SEQ + 1);
-    recv_tail = (recv_tail + 1) %(MAX_SEQ + 1);
+    l->recv_front = (l->recv_front + 1) % (MAX_SEQ + 1);
+    l->recv_tail = (l->recv_tail + 1) %(MAX_SEQ + 1);
     return ret;
 }
-static void send_data_frame(uint8 seq){
-    FRAME_ITER iter = &post_window[seq%WINDOW_SIZE];
+static void send_data_frame(LINK *l, uint8 seq){
+    FRAME_ITER iter = &l->post_window[seq%WINDOW_SIZE];
     
-    put_frame((byte*)iter,3 + PKT_LEN);
+    //Piggyback the oldest ACK owed now: one kept from the first send would be stale on a resend
+    if(is_ack_seq_empty(l)){
+        iter->ack = MAX_SEQ + 1;//NO ACK Provided
+    }else{
+        iter->ack = pop_oldest_ack_seq(l);
+    }
+    if(l->cut_through){
+        iter->hcs = crc8(&iter->kind,3);
+    }
+    //Only the header is hashed here, the payload FCS was cached by post_window_push()
+    put_frame_fcs(l, frame_start(l, iter),l->hdr_len + PKT_LEN,fcs_combine(fcs_update(fcs_init(),frame_start(l, iter),l->hdr_len),l->post_fcs[seq%WINDOW_SIZE],PKT_LEN));
 
     dbg_frame("Send DATA %d, Seq Num %d, Piggybacking %d, ID %d\n", iter->seq, seq, iter->ack, *(short *)iter->data);
     start_timer(seq,DATA_TIMER);
     dbg_frame("Start Timer %d\n",seq);
     //stop_ack_timer();
-    post_arrived[seq%WINDOW_SIZE] = FALSE;
+    l->post_arrived[seq%WINDOW_SIZE] = FALSE;
     
     //TODO 如果还有ACK帧,重开ACK timer
-    /*if(!is_ack_seq_empty()){
+    /*if(!is_ack_seq_empty(l)){
         start_ack_timer(ACK_TIMER);
     }*/
 }
-static void put_frame(byte *frame, int len){
-    *(uint32 *)(frame + len) = crc32(frame, len);
-    send_frame(frame, len + 4);
-    phl_ready = 0;
+static void put_frame_fcs(LINK *l, byte *frame, int len, uint32 reg){
+    send_frame(frame, fcs_put(frame, len, reg));
+    l->phl_ready = 0;
 }
 
-static void post_window_push(byte *buf,int32 len){
-    FRAME_ITER iter = &post_window[next_frame_id%WINDOW_SIZE];
+static void post_window_push(LINK *l, byte *buf,int32 len){
+    FRAME_ITER iter = &l->post_window[l->next_frame_id%WINDOW_SIZE];
     memcpy(iter->data,buf,len);
+    l->post_fcs[l->next_frame_id%WINDOW_SIZE] = fcs_update(fcs_init(),iter->data,len);
     iter->kind = FRAME_DATA;
-    iter->seq = next_frame_id;
-    if(is_ack_seq_empty()){
-        iter->ack = MAX_SEQ + 1;//NO ACK Provided
-    }else{
-        iter->ack = pop_oldest_ack_seq();
-    }
+    iter->seq = l->next_frame_id;
 }
-static void send_ack_frame(uint8 seq){
-    FRAME s;
-    s.kind = FRAME_ACK;
-    s.ack = seq;
-    
-    dbg_frame("Send ACK  %d\n", s.ack);
+static void send_ack_frame(LINK *l, uint8 seq){
+    dbg_frame("Send ACK  %d\n", seq);
 
-    put_frame((unsigned char *)&s, 2);
+    put_ctrl_frame(l, FRAME_ACK, seq);
 }
 
-static uint8 pop_oldest_ack_seq(){
-    uint8 ret = ack_sequence[ack_sequence_front % SEQ_MOD];
-    ack_sequence_front = (ack_sequence_front + 1) % SEQ_MOD;
+static uint8 pop_oldest_ack_seq(LINK *l){
+    uint8 ret = l->ack_sequence[l->ack_sequence_front % SEQ_MOD];
+    l->ack_sequence_front = (l->ack_sequence_front + 1) % SEQ_MOD;
     return ret;
 }
-static void push_ack_seq(uint8 seq){
-    ack_sequence[ack_sequence_tail % SEQ_MOD] = seq;
-    ack_sequence_tail = (ack_sequence_tail + 1) % SEQ_MOD;
+static void push_ack_seq(LINK *l, uint8 seq){
+    l->ack_sequence[l->ack_sequence_tail % SEQ_MOD] = seq;
+    l->ack_sequence_tail = (l->ack_sequence_tail + 1) % SEQ_MOD;
 }
-static bool is_ack_seq_empty(){
-    return ack_sequence_front==ack_sequence_tail;
+static bool is_ack_seq_empty(LINK *l){
+    return l->ack_sequence_front==l->ack_sequence_tail;
 }
 
-static void send_nak_frame(uint8 seq){
-    FRAME s;
-    s.kind = FRAME_NAK;
-    s.ack = seq;
-    
-    dbg_frame("Send NAK  %d\n", s.ack);
+static void send_nak_frame(LINK *l, uint8 seq){
+    dbg_frame("Send NAK  %d\n", seq);
+
+    put_ctrl_frame(l, FRAME_NAK, seq);
+}
+
+static void put_ctrl_frame(LINK *l, uint8 kind, uint8 seq){
+    byte s[CTRL_LEN];
+    uint32 fcs;
 
-    put_frame((unsigned char *)&s, 2);
+    s[0] = kind | FRAME_COMPACT;
+    s[1] = seq;
+    fcs = crc16(s, 2);
+    s[2] = fcs & 0xff;
+    s[3] = fcs >> 8;
+    send_frame(s, CTRL_LEN);
+    l->phl_ready = 0;
+}
+static bool is_ctrl_frame_good(byte *frame, int32 len){
+    uint8 kind = frame[0] & FRAME_KIND_MASK;
+
+    if(len != CTRL_LEN || !(frame[0] & FRAME_COMPACT) || (kind != FRAME_ACK && kind != FRAME_NAK)){
+        return FALSE;
+    }
+    return crc16(frame, 2) == (uint32)(frame[2] | frame[3] << 8);
 }
\ No newline at end of file
@@ -4,21 +4,30 @@
 #define FRAME_ACK  2
 #define FRAME_NAK  3
 
+/* FRAME flags, high bits of KIND */
+#define FRAME_COMPACT   0x80 /* ACK/NAK protected by FCS-16 instead of the frame FCS */
+#define FRAME_KIND_MASK 0x0f
+
 /*  
     DATA Frame
     +=========+========+========+===============+========+
-    | KIND(1) | SEQ(1) | ACK(1) | DATA(240~256) | CRC(4) |
+    | KIND(1) | SEQ(1) | ACK(1) | DATA(240~256) | FCS(4) |
     +=========+========+========+===============+========+
 
-    ACK Frame
-    +=========+========+========+
-    | KIND(1) | ACK(1) | CRC(4) |
-    +=========+========+========+
+    DATA Frame, cut-through mode (HCS = CRC-8 over KIND, SEQ, ACK)
+    +========+=========+========+========+===============+========+
+    | HCS(1) | KIND(1) | SEQ(1) | ACK(1) | DATA(240~256) | FCS(4) |
+    +========+=========+========+========+===============+========+
+
+    ACK Frame (KIND = FRAME_ACK | FRAME_COMPACT)
+    +=========+========+===========+
+    | KIND(1) | ACK(1) | FCS-16(2) |
+    +=========+========+===========+
 
-    NAK Frame
-    +=========+========+========+
-    | KIND(1) | ACK(1) | CRC(4) |
-    +=========+========+========+
+    NAK Frame (KIND = FRAME_NAK | FRAME_COMPACT)
+    +=========+========+===========+
+    | KIND(1) | ACK(1) | FCS-16(2) |
+    +=========+========+===========+
 */
 
 
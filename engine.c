@@ -0,0 +1,254 @@
+/*
+    An engine run (--links) emulates many station pairs in one process.
+    Links are dealt out round robin to --cores shard threads, each
+    pinned to a CPU with one epoll instance and timerfd for all of its
+    stations; both stations of a link sit in the same shard, joined by
+    a socketpair(). A shard pass runs every station that is due or has
+    socket data until it has no event left, then sleeps until the
+    earliest deadline of them all, exactly as epoll_sleep() would for
+    a single station.
+*/
+
+#include "phl.h"
+
+#ifdef HAVE_ENGINE
+
+struct SHARD {
+    int id;
+    pthread_t thread;
+    int epfd, tfd;
+    int n;                 /* stations */
+    struct STATION **sts;
+    unsigned int wakeups, syscalls;
+};
+
+static struct SHARD *shards;
+
+/* Both stations of link 'link', first touched by the shard that runs them */
+static void shard_link(struct SHARD *sh, int link)
+{
+    struct STATION *s;
+    struct epoll_event ev;
+    int sv[2], i, buf_size = 1024 * 64;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        ABORT("system socketpair()");
+
+    for (i = 0; i < 2; i++) {
+        s = (struct STATION *)malloc(sizeof(struct STATION));
+        if (s == NULL)
+            ABORT("No enough memory");
+        station_init(s);
+        station_enter(s);
+        s->station = i == 0 ? 'a' : 'b';
+        s->seed = (unsigned int)(mode_seed ^ (i == 0 ? 97209 : 18231)) + link * 0x9e3779b97f4a7c15ULL;
+        s->chan_bps = ch->bps = mode_rate[0];
+        s->shard = sh;
+        ch->sock = sv[i];
+
+        setsockopt(ch->sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(ch->sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
+        if (fcntl(ch->sock, F_SETFL, fcntl(ch->sock, F_GETFL) | O_NONBLOCK) < 0)
+            ABORT("system fcntl(O_NONBLOCK)");
+
+        delay_line_init();
+        pacer_init();
+
+        s->epfd = sh->epfd;
+        ch->ep_fd = ch->sock;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ch;
+        if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, ch->sock, &ev) < 0)
+            ABORT("system epoll_ctl()");
+
+        s->ctx = calloc(1, layer2_ctx_size > 0 ? layer2_ctx_size : 1);
+        if (s->ctx == NULL)
+            ABORT("No enough memory");
+        layer2_init(s->ctx);
+
+        sh->sts[sh->n++] = s;
+    }
+}
+
+/* Sleep until 'next', or until socket data comes in if that is more than a line byte time away */
+static void shard_sleep(struct SHARD *sh, long long next)
+{
+    struct epoll_event evs[64];
+    struct itimerspec its;
+    struct CHANNEL *c;
+    unsigned long long expirations;
+    long long us, t, slack;
+    int i, n;
+
+    magic_check();
+
+    us = next - get_us();
+    if (us <= 0)
+        return;
+    sh->wakeups++;
+    sh->syscalls++;
+
+    /* absolute, on the monotonic clock */
+    t = next + mono_base;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(t / 1000000);
+    its.it_value.tv_nsec = (long)(t % 1000000) * 1000;
+
+    for (i = 0, slack = -1; i < sh->n; i++) {
+        if (slack < 0 || rx_slack(sh->sts[i]) < slack)
+            slack = rx_slack(sh->sts[i]);
+    }
+    if (us <= slack) {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &its.it_value, NULL);
+        return;
+    }
+
+    if (timerfd_settime(sh->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        ABORT("system timerfd_settime()");
+    sh->syscalls++;
+
+    n = epoll_wait(sh->epfd, evs, 64, -1);
+    if (n < 0 && errno != EINTR)
+        ABORT("system epoll_wait()");
+
+    for (i = 0; i < n; i++) {
+        c = (struct CHANNEL *)evs[i].data.ptr;
+        if (c == NULL) {
+            if (read(sh->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                ABORT("system read(timerfd)");
+            sh->syscalls++;
+            continue;
+        }
+        c->ep_ready = evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? SOCK_RD : 0;
+        if (evs[i].events & EPOLLOUT)
+            c->tx_blocked = 0;
+        if (!c->tx_blocked)
+            c->ep_ready |= SOCK_WR;
+        c->ep_fresh = 1;
+    }
+}
+
+static void *shard_main(void *arg)
+{
+    struct SHARD *sh = (struct SHARD *)arg;
+    struct STATION *s;
+    long long t, next, life = (mode_life + 1) * 1000LL;
+    int i, event, nr;
+    cpu_set_t cpus;
+
+    /* the engine reports for all stations at the end, they say nothing themselves */
+    lprintf_quiet(1);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(sh->id % (int)sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (mode_pace)
+        prctl(PR_SET_TIMERSLACK, 1000UL);
+
+    sh->epfd = epoll_create1(0);
+    sh->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (sh->epfd < 0 || sh->tfd < 0)
+        ABORT("system epoll_create1()/timerfd_create()");
+    {
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->tfd, &ev) < 0)
+            ABORT("system epoll_ctl()");
+    }
+
+    sh->sts = (struct STATION **)malloc(2 * (mode_links / mode_cores + 1) * sizeof(struct STATION *));
+    if (sh->sts == NULL)
+        ABORT("No enough memory");
+    for (i = sh->id; i < mode_links; i += mode_cores)
+        shard_link(sh, i);
+
+    for (;;) {
+        t = get_us();
+        if (t >= life)
+            break;
+
+        next = life;
+        for (i = 0; i < sh->n; i++) {
+            s = sh->sts[i];
+            if (s->due <= t || s->chan0.ep_fresh) {
+                station_enter(s);
+                while ((event = phl_poll(&nr)) >= 0)
+                    layer2_handler(s->ctx, event, nr);
+                s->due = next_deadline();
+                /* a full delay line leaves socket data where it is, as epoll_sleep() does */
+                epoll_watch((dl_room() ? EPOLLIN : 0) | (ch->tx_blocked ? EPOLLOUT : 0));
+            }
+            if (s->due < next)
+                next = s->due;
+        }
+
+        shard_sleep(sh, next);
+    }
+    return NULL;
+}
+
+static void engine_report(double secs)
+{
+    struct STATION *s;
+    double frames = 0, packets = 0, syscalls = 0, wakeups = 0, late_sum = 0, fires = 0;
+    long long late_max = 0;
+    struct rusage ru;
+    int i, k;
+
+    for (i = 0; i < mode_cores; i++) {
+        wakeups += shards[i].wakeups;
+        syscalls += shards[i].syscalls;
+        for (k = 0; k < shards[i].n; k++) {
+            s = shards[i].sts[k];
+            frames += s->tx_frames;
+            packets += s->rpackets;
+            syscalls += s->loop_syscalls;
+            fires += s->timer_fires;
+            late_sum += s->timer_late_sum;
+            if (s->timer_late_max > late_max)
+                late_max = s->timer_late_max;
+        }
+    }
+    getrusage(RUSAGE_SELF, &ru);
+
+    lprintf("Engine: %d links on %d cores, %.1f s, %.0f frames (%.0f/s, %.1f/s per link), %.0f packets received (%.0f/s)\n",
+        mode_links, mode_cores, secs, frames, frames / secs, frames / secs / mode_links, packets, packets / secs);
+    lprintf("Engine: %.0f wakeups (%.1f/s), %.2f system calls per frame, timer late avg %.0f us, max %lld us, CPU %.0f%%\n",
+        wakeups, wakeups / secs, frames ? syscalls / frames : 0.0, fires ? late_sum / fires : 0.0, late_max,
+        (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6) / secs * 100);
+}
+
+void engine_run(void)
+{
+    int i;
+
+    epoch_us = wall_us();
+    clock_init();
+    if (mode_fcs < 0)
+        mode_fcs = FCS_CRC32;
+    if (mode_rate[0] == 0)
+        mode_rate[0] = CHAN_BPS;
+    fcs_select(mode_fcs);
+
+    lprintf("Line rate %d bps, frame check sequence: %s%s\n", mode_rate[0], fcs_name(fcs_type()),
+        mode_cut_through ? ", cut-through" : "");
+    lprintf("=================================================================\n\n");
+
+    shards = (struct SHARD *)calloc(mode_cores, sizeof(struct SHARD));
+    if (shards == NULL)
+        ABORT("No enough memory");
+    for (i = 0; i < mode_cores; i++) {
+        shards[i].id = i;
+        if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0)
+            ABORT("system pthread_create()");
+    }
+    for (i = 0; i < mode_cores; i++)
+        pthread_join(shards[i].thread, NULL);
+
+    engine_report(get_us() / 1e6);
+    lprintf("Quit.\n");
+}
+
+#endif /* HAVE_ENGINE */
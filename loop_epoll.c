@@ -0,0 +1,193 @@
+/*
+    epoll event loop: the station sleeps in epoll_wait() until its next
+    deadline, armed on a timerfd, or until a channel has socket data.
+    Sockets are nonblocking; a full one is watched for EPOLLOUT.
+*/
+
+#include "phl.h"
+
+#ifdef HAVE_EPOLL
+
+/* The station's epoll instance, with every channel and the timerfd in it */
+void epoll_init(void)
+{
+    struct epoll_event ev;
+    int i;
+
+    st->epfd = epoll_create1(0);
+    st->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (st->epfd < 0 || st->tfd < 0)
+        ABORT("system epoll_create1()/timerfd_create()");
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if (fcntl(ch->sock, F_SETFL, fcntl(ch->sock, F_GETFL) | O_NONBLOCK) < 0)
+            ABORT("system fcntl(O_NONBLOCK)");
+
+        ch->ep_fd = ch->sock;
+#ifdef HAVE_SHM
+        if (ch->shm_rx)
+            ch->ep_fd = ch->shm_rx_efd;
+#endif
+        ev.events = EPOLLIN;
+        ev.data.ptr = ch;
+        if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, ch->ep_fd, &ev) < 0)
+            ABORT("system epoll_ctl()");
+    }
+    ch = st->chan[0];
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, st->tfd, &ev) < 0)
+        ABORT("system epoll_ctl()");
+
+    /* the default 50 us timer slack would swamp short pacing intervals */
+    if (mode_pace)
+        prctl(PR_SET_TIMERSLACK, 1000UL);
+}
+
+void epoll_watch(int events)
+{
+    struct epoll_event ev;
+
+    if (events == ch->ep_events)
+        return;
+    ev.events = events;
+    ev.data.ptr = ch;
+    if (epoll_ctl(st->epfd, EPOLL_CTL_MOD, ch->ep_fd, &ev) < 0)
+        ABORT("system epoll_ctl()");
+    st->loop_syscalls++;
+    ch->ep_events = events;
+}
+
+/* Readiness of every channel of the station, fresh for its next epoll_poll() */
+static void epoll_collect(int timeout)
+{
+    struct epoll_event evs[BOND_MAX + 1];
+    struct CHANNEL *c;
+    unsigned long long expirations;
+    int i, n;
+
+    n = epoll_wait(st->epfd, evs, BOND_MAX + 1, timeout);
+    if (n < 0 && errno != EINTR)
+        ABORT("system epoll_wait()");
+    st->loop_syscalls++;
+
+    for (i = 0; i < st->nchan; i++)
+        st->chan[i]->ep_ready = 0;
+
+    for (i = 0; i < n; i++) {
+        if (evs[i].data.ptr == NULL) { /* the timerfd */
+            if (read(st->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                ABORT("system read(timerfd)");
+            st->loop_syscalls++;
+            continue;
+        }
+#ifdef HAVE_PHY_THREAD
+        if (evs[i].data.ptr == &phy0) { /* the data link thread has handed over frames */
+            if (read(phy0.phy_efd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                ABORT("system read(eventfd)");
+            st->loop_syscalls++;
+            continue;
+        }
+#endif
+        c = (struct CHANNEL *)evs[i].data.ptr;
+#ifdef HAVE_SHM
+        if (c->shm_rx && read(c->shm_rx_efd, &expirations, sizeof(expirations)) >= 0)
+            st->loop_syscalls++;
+#endif
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            c->ep_ready |= SOCK_RD;
+        if (evs[i].events & EPOLLOUT)
+            c->tx_blocked = 0;
+    }
+
+    for (i = 0; i < st->nchan; i++) {
+        c = st->chan[i];
+        if (!c->tx_blocked)
+            c->ep_ready |= SOCK_WR;
+        if (!(c->ep_events & EPOLLIN))
+            c->ep_ready |= SOCK_RD;
+        c->ep_fresh = 1;
+    }
+}
+
+int epoll_poll(void)
+{
+    if (ch->ep_fresh) {
+        ch->ep_fresh = 0;
+        return ch->ep_ready;
+    }
+    if (st->shard) /* only the shard's epoll_wait() collects, for all of its stations */
+        return (ch->tx_blocked ? 0 : SOCK_WR) | (ch->ep_events & EPOLLIN ? 0 : SOCK_RD);
+#ifdef HAVE_SHM
+    if (ch->shm_rx) /* socket_recv() looks at the ring itself */
+        return SOCK_RD | SOCK_WR;
+#endif
+    epoll_watch(EPOLLIN | (ch->tx_blocked ? EPOLLOUT : 0));
+    epoll_collect(0);
+    ch->ep_fresh = 0;
+    return ch->ep_ready;
+}
+
+/* Sleep until the next deadline, or until a watched channel has socket data */
+void epoll_sleep(void)
+{
+    struct itimerspec its;
+    long long us, slack;
+    int i;
+
+    magic_check();
+
+    us = next_deadline() - get_us();
+    if (us <= 0)
+        return;
+
+    /* 
+        A wakeup due within a line byte time reads the socket anyway: leave
+        it unwatched until then.
+    */
+    slack = rx_slack(st);
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+#ifdef HAVE_SHM
+        if (ch->shm_rx) {
+            /* the doorbell stays watched: the peer rings it only while we say we sleep */
+            if (us > slack && dl_room() && shm_rx_idle(1)) {
+                shm_rx_idle(0);
+                return;
+            }
+        } else
+#endif
+        epoll_watch((us > slack && dl_room() ? EPOLLIN : 0) | (ch->tx_blocked ? EPOLLOUT : 0));
+    }
+    ch = st->chan[0];
+
+#ifdef HAVE_PHY_THREAD
+    /* as the shared memory doorbell: the data link thread rings only while we say we sleep */
+    if (st == &phy0.station && phy_tx_idle(1)) {
+        phy_tx_idle(0);
+        return;
+    }
+#endif
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(us / 1000000);
+    its.it_value.tv_nsec = (long)(us % 1000000) * 1000;
+    if (timerfd_settime(st->tfd, 0, &its, NULL) < 0)
+        ABORT("system timerfd_settime()");
+    st->loop_syscalls++;
+
+    epoll_collect(-1);
+    st->loop_wakeups++;
+#ifdef HAVE_SHM
+    if (ch->shm_rx)
+        shm_rx_idle(0);
+#endif
+#ifdef HAVE_PHY_THREAD
+    if (st == &phy0.station)
+        phy_tx_idle(0);
+#endif
+}
+
+#endif /* HAVE_EPOLL */
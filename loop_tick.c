@@ -0,0 +1,81 @@
+/*
+    Tick event loop: a select() with no timeout tests each channel's
+    socket, and the station then sleeps a fixed 'mode_tick' ms whether
+    anything is due or not. Portable, and the only loop on Windows.
+*/
+
+#include "phl.h"
+
+int select_poll(void)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
+    int nfds, ready = 0;
+
+#ifdef HAVE_SHM
+    if (ch->shm_rx) /* socket_recv() looks at the ring itself */
+        return SOCK_RD | SOCK_WR;
+#endif
+
+    tm.tv_sec = tm.tv_usec = 0;
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    FD_SET(ch->sock, &rfd);
+    FD_SET(ch->sock, &wfd);
+
+    nfds = (int)(ch->sock + 1);
+    if (select(nfds, &rfd, &wfd, 0, &tm) < 0) 
+        ABORT("system select()");
+    st->loop_syscalls++;
+
+    if (FD_ISSET(ch->sock, &rfd))
+        ready |= SOCK_RD;
+    if (FD_ISSET(ch->sock, &wfd))
+        ready |= SOCK_WR;
+    return ready;
+}
+
+static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
+static int bias_cnt;
+
+/* Sleep 'mode_tick' ms, warning when the system wakes us up much later */
+void tick_sleep(void)
+{
+    if (1) {
+        int ms0, t;
+        static time_t last_warn;
+        ms0 = get_ms();
+        magic_check();
+        Sleep(mode_tick);
+        st->loop_wakeups++;
+        st->loop_syscalls++;
+        t = get_ms() - ms0;
+        if (t > mode_tick + 50 && time(0) > last_warn + 1) {
+            lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
+                mode_tick, t);
+            last_warn = time(0);
+        }
+    } else {
+        int ticks, ms;
+
+        sleep_cnt++;
+
+        ms = get_ms();
+        if (start_ms == 0)
+            start_ms = ms;
+        else if (ms - wakeup_ms > 1) {
+            ticks = (ms - start_ms) / mode_tick;
+            lprintf("====== CPU BUSY for %d ms (cnt %d)\n", ms - wakeup_ms, ++busy_cnt);
+            lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
+        }
+
+        magic_check();
+        ms = get_ms();
+        Sleep(mode_tick);
+        wakeup_ms = get_ms();
+
+        ms = wakeup_ms - ms;
+        if (ms > mode_tick + 1 || ms < mode_tick - 1) 
+            lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
+    }
+}
@@ -0,0 +1,278 @@
+/*
+    io_uring backend. One multishot recv, armed once, fills a ring of
+    buffers registered with the kernel; the received bytes are copied
+    into the delay line as they are reaped. Sends go out as a chain of
+    linked SQEs straight from the sending queue, and the sleep until the
+    next deadline is the timeout of the io_uring_enter() that submits
+    them. Reaping completions is a memory read, so a loop pass with
+    nothing to submit makes no system call at all.
+*/
+
+#include "phl.h"
+
+#ifdef HAVE_IO_URING
+
+#define UR_ENTRIES  64
+#define UR_BUF_SIZE 16384
+#define UR_RECV     1     /* user_data: the multishot recv */
+#define UR_SEND     2     /* user_data: a send, length << 8 */
+
+static void uring_enter(unsigned int wait, long long us)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int ret;
+
+    memset(&arg, 0, sizeof(arg));
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    arg.ts = (unsigned long long)(unsigned long)&ts;
+
+    ret = (int)syscall(__NR_io_uring_enter, st->ur_fd, st->ur_to_submit, wait,
+        wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    st->loop_syscalls++;
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        ABORT("system io_uring_enter()");
+    if (ret > 0)
+        st->ur_to_submit -= (unsigned int)ret < st->ur_to_submit ? (unsigned int)ret : st->ur_to_submit;
+    if (st->ur_to_submit == 0) {
+        st->ur_sends_new = 0;
+        st->ur_last_send = NULL;
+    }
+}
+
+/* Next free SQE; the kernel reads the ring only in io_uring_enter(), so it is published at once */
+static struct io_uring_sqe *uring_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail = *st->ur_sq_tail, idx;
+
+    if (tail - __atomic_load_n(st->ur_sq_head, __ATOMIC_ACQUIRE) >= st->ur_sq_entries) {
+        uring_enter(0, 0);
+        tail = *st->ur_sq_tail;
+    }
+
+    idx = tail & st->ur_sq_mask;
+    sqe = &st->ur_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    st->ur_sq_array[idx] = idx;
+    __atomic_store_n(st->ur_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    st->ur_to_submit++;
+    return sqe;
+}
+
+static void uring_recv_arm(void)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ch->sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = UR_RECV;
+    st->ur_recv_armed = 1;
+}
+
+/* Give receive buffer 'bid' back to the kernel */
+static void uring_buf_put(int bid)
+{
+    struct io_uring_buf *b = &st->ur_br->bufs[st->ur_br_tail & (UR_BUFS - 1)];
+
+    b->addr = (unsigned long)(st->ur_buf + bid * UR_BUF_SIZE);
+    b->len = UR_BUF_SIZE;
+    b->bid = (unsigned short)bid;
+    st->ur_br_tail++;
+}
+
+/* Sends of separate submissions may pass each other: one chain is in flight at a time */
+int uring_send(const unsigned char *buf, int len)
+{
+    struct io_uring_sqe *sqe;
+
+    if (st->ur_last_send)
+        st->ur_last_send->flags |= IOSQE_IO_LINK;
+
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = ch->sock;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = (unsigned int)len;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = UR_SEND | (unsigned long long)len << 8;
+
+    st->ur_last_send = sqe;
+    st->ur_sends++;
+    st->ur_sends_new++;
+    ch->sq_flight += len;
+    return len;
+}
+
+/* Reap all completions, returns nonzero if any receive came in */
+static int uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head = *st->ur_cq_head, tail = __atomic_load_n(st->ur_cq_tail, __ATOMIC_ACQUIRE);
+    int received = 0;
+
+    for (; head != tail; head++) {
+        cqe = &st->ur_cqes[head & st->ur_cq_mask];
+        if ((cqe->user_data & 0xff) == UR_SEND) {
+            if (cqe->res != (int)(cqe->user_data >> 8)) {
+                lprintf("TCP Disconnected.\n");
+                exit(0);
+            }
+            ch->sq_flight -= cqe->res;
+            st->ur_sends--;
+            continue;
+        }
+
+        if (cqe->res > 0) {
+            st->ur_rx[st->ur_rx_tail % UR_BUFS].bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            st->ur_rx[st->ur_rx_tail % UR_BUFS].len = cqe->res;
+            st->ur_rx[st->ur_rx_tail % UR_BUFS].off = 0;
+            st->ur_rx_tail++;
+            received = 1;
+        } else if (cqe->res != -ENOBUFS) {
+            lprintf("TCP disconnected.\n");
+            exit(0);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) /* out of buffers: re-armed once some come back */
+            st->ur_recv_armed = 0;
+    }
+    __atomic_store_n(st->ur_cq_head, head, __ATOMIC_RELEASE);
+    return received;
+}
+
+/* Move received bytes into the delay line while it has room; TCP holds the peer back otherwise */
+static void uring_recv(void)
+{
+    unsigned int room, pos, n, first;
+    unsigned short tail = st->ur_br_tail;
+    unsigned char *p;
+
+    while (st->ur_rx_head != st->ur_rx_tail && (room = dl_room()) > 0) {
+        p = st->ur_buf + st->ur_rx[st->ur_rx_head % UR_BUFS].bid * UR_BUF_SIZE + st->ur_rx[st->ur_rx_head % UR_BUFS].off;
+        n = (unsigned int)(st->ur_rx[st->ur_rx_head % UR_BUFS].len - st->ur_rx[st->ur_rx_head % UR_BUFS].off);
+        if (n > room)
+            n = room;
+        pos = ch->dl_tail & ch->dl_mask;
+        first = n < ch->dl_size - pos ? n : ch->dl_size - pos;
+        memcpy(ch->dl + pos, p, first);
+        memcpy(ch->dl, p + first, n - first);
+        dl_append((int)n);
+
+        st->ur_rx[st->ur_rx_head % UR_BUFS].off += (int)n;
+        if (st->ur_rx[st->ur_rx_head % UR_BUFS].off == st->ur_rx[st->ur_rx_head % UR_BUFS].len)
+            uring_buf_put(st->ur_rx[st->ur_rx_head++ % UR_BUFS].bid);
+    }
+
+    if (st->ur_br_tail != tail) {
+        __atomic_store_n(&st->ur_br->tail, st->ur_br_tail, __ATOMIC_RELEASE);
+        if (!st->ur_recv_armed)
+            uring_recv_arm();
+    }
+}
+
+int uring_poll(void)
+{
+    if (st->ur_to_submit) /* queued by a pass that did not sleep */
+        uring_enter(0, 0);
+    uring_reap();
+    uring_recv();
+
+    /* a chain submitted earlier has not gone out: wait for its completion */
+    ch->tx_blocked = st->ur_sends > st->ur_sends_new;
+    return SOCK_WR;
+}
+
+void uring_sleep(void)
+{
+    unsigned int wait;
+    long long us, slack = rx_slack(st);
+
+    magic_check();
+
+    us = next_deadline() - get_us();
+    if (uring_reap() && us > slack)
+        us = 0;
+    if (us <= 0) {
+        if (st->ur_to_submit)
+            uring_enter(0, 0);
+        return;
+    }
+
+    /* 
+        The sends submitted here complete at once, one CQE each: wait for
+        one completion more than that. Within a line byte time of the deadline only
+        the timeout ends the wait, as with epoll.
+    */
+    wait = us > slack && dl_room() ? st->ur_sends_new + 1 : st->ur_cq_entries;
+    uring_enter(wait, us);
+    st->loop_wakeups++;
+}
+
+void uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned char *ring;
+    size_t size;
+    int i;
+
+    /* completions are only run in io_uring_enter(), not by waking us up for each (Linux 6.1) */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    st->ur_fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (st->ur_fd < 0) {
+        memset(&p, 0, sizeof(p));
+        st->ur_fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    }
+    if (st->ur_fd < 0)
+        ABORT("system io_uring_setup()");
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+        ABORT("io_uring: kernel too old");
+
+    size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, st->ur_fd, IORING_OFF_SQ_RING);
+    st->ur_sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, st->ur_fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || st->ur_sqes == MAP_FAILED)
+        ABORT("system mmap(io_uring)");
+
+    st->ur_sq_head = (unsigned int *)(ring + p.sq_off.head);
+    st->ur_sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    st->ur_sq_array = (unsigned int *)(ring + p.sq_off.array);
+    st->ur_sq_mask = *(unsigned int *)(ring + p.sq_off.ring_mask);
+    st->ur_sq_entries = p.sq_entries;
+    st->ur_cq_head = (unsigned int *)(ring + p.cq_off.head);
+    st->ur_cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    st->ur_cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    st->ur_cq_mask = *(unsigned int *)(ring + p.cq_off.ring_mask);
+    st->ur_cq_entries = p.cq_entries;
+
+    /* receive buffers, handed to the kernel through a registered buffer ring */
+    st->ur_br = (struct io_uring_buf_ring *)mmap(NULL, UR_BUFS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    st->ur_buf = (unsigned char *)malloc(UR_BUFS * UR_BUF_SIZE);
+    if (st->ur_br == MAP_FAILED || st->ur_buf == NULL)
+        ABORT("No enough memory");
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)st->ur_br;
+    reg.ring_entries = UR_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, st->ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        ABORT("system io_uring_register(PBUF_RING)");
+
+    for (i = 0; i < UR_BUFS; i++)
+        uring_buf_put(i);
+    __atomic_store_n(&st->ur_br->tail, st->ur_br_tail, __ATOMIC_RELEASE);
+
+    uring_recv_arm();
+    uring_enter(0, 0);
+}
+
+#endif /* HAVE_IO_URING */
@@ -6,9 +6,22 @@
 #endif
 
 #include <windows.h>
+#define THREAD_LOCAL __declspec(thread)
+
+/* one lprintf() at a time: the line state and log_file are shared by all threads */
+static SRWLOCK output_lock = SRWLOCK_INIT;
+#define output_acquire() AcquireSRWLockExclusive(&output_lock)
+#define output_release() ReleaseSRWLockExclusive(&output_lock)
 
 #else
+#include <pthread.h>
 #define __int64 long long
+#define THREAD_LOCAL __thread
+
+/* one lprintf() at a time: the line state and log_file are shared by all threads */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+#define output_acquire() pthread_mutex_lock(&output_lock)
+#define output_release() pthread_mutex_unlock(&output_lock)
 #endif
 
 #include <sys/types.h>
@@ -22,6 +35,8 @@
 
 FILE *log_file = NULL;
 
+static THREAD_LOCAL int quiet; /* lprintf_quiet() */
+
 #define bool int
 #define true 1
 #define false 0
@@ -359,7 +374,7 @@ static size_t output_memory_block(const unsigned char *ptr, int n, size_t width,
     return len;
 }
 
-size_t __v_lprintf(const char *format, va_list arg_ptr)
+static size_t v_output(const char *format, va_list arg_ptr)
 {
     size_t len = 0, l;
     signed int n;
@@ -564,6 +579,24 @@ print_num:
     return len;
 }
 
+size_t __v_lprintf(const char *format, va_list arg_ptr)
+{
+    size_t len;
+
+    if (quiet)
+        return 0;
+
+    output_acquire();
+    len = v_output(format, arg_ptr);
+    output_release();
+    return len;
+}
+
+void lprintf_quiet(int on)
+{
+    quiet = on;
+}
+
 size_t lprintf(const char *format, ...)
 {
     size_t n;
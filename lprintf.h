@@ -13,6 +13,8 @@ extern unsigned int get_ms(void);
 
 size_t lprintf(const char *format, ...);
 size_t __v_lprintf(const char *format, va_list arg_ptr);
+/* Drop (on != 0) or print again this thread's output */
+void lprintf_quiet(int on);
 
 #ifdef __cplusplus
 }
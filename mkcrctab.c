@@ -0,0 +1,102 @@
+/*
+    Build-time generator for the CRC lookup tables used by crc32.c
+
+    Usage: mkcrctab > crctab.h
+*/
+
+#include <stdio.h>
+
+#define CRC32_POLY  0xedb88320L /* reflected x^32 + x^26 + ... + x + 1 (CRC-32, FCS-32) */
+#define CRC32C_POLY 0x82f63b78L /* reflected Castagnoli polynomial (CRC-32C) */
+#define FCS16_POLY  0x8408      /* reflected x^16 + x^12 + x^5 + 1 (RFC 1662 FCS-16) */
+#define CRC8_POLY   0xe0        /* reflected x^8 + x^2 + x + 1 (header check) */
+#define NSLICE      16
+
+static unsigned int table[NSLICE][256];
+
+static void make_table(unsigned int poly)
+{
+    unsigned int n, k, c;
+
+    for (n = 0; n < 256; n++) {
+        c = n;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? poly ^ (c >> 1) : c >> 1;
+        table[0][n] = c;
+    }
+
+    /* table[k][n]: CRC of byte n followed by k zero bytes */
+    for (n = 0; n < 256; n++) {
+        c = table[0][n];
+        for (k = 1; k < NSLICE; k++) {
+            c = table[0][c & 0xff] ^ (c >> 8);
+            table[k][n] = c;
+        }
+    }
+}
+
+/* a(x) * b(x) mod P, reflected, for a 'width'-bit register */
+static unsigned int multmodp(unsigned int a, unsigned int b, unsigned int poly, int width)
+{
+    unsigned int m = 1U << (width - 1), p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+    }
+    return p;
+}
+
+/* x^(2^n) mod P for n = 0..31, used to combine CRCs */
+static void print_x2n(const char *name, unsigned int poly, int width)
+{
+    unsigned int n, p = 1U << (width - 2); /* x^1 */
+
+    printf("static const unsigned int %s[32] = {", name);
+    for (n = 0; n < 32; n++) {
+        printf("%s0x%08xL%s", n % 5 ? " " : "\n    ", p, n == 31 ? "" : ",");
+        p = multmodp(p, p, poly, width);
+    }
+    printf("\n};\n\n");
+}
+
+static void print_table(const char *name, int nslice)
+{
+    int k, n;
+
+    printf("static const unsigned int %s[%d][256] = {\n", name, nslice);
+    for (k = 0; k < nslice; k++) {
+        printf("  {");
+        for (n = 0; n < 256; n++)
+            printf("%s0x%08xL%s", n % 5 ? " " : "\n    ", table[k][n], n == 255 ? "" : ",");
+        printf("\n  }%s\n", k == nslice - 1 ? "" : ",");
+    }
+    printf("};\n\n");
+}
+
+int main(void)
+{
+    printf("/* Generated by mkcrctab, do not edit */\n\n");
+
+    make_table(CRC32_POLY);
+    print_table("crc_table", NSLICE);
+    print_x2n("crc_x2n_table", CRC32_POLY, 32);
+
+    make_table(CRC32C_POLY);
+    print_table("crc32c_table", 8);
+    print_x2n("crc32c_x2n_table", CRC32C_POLY, 32);
+
+    make_table(FCS16_POLY);
+    print_table("fcs16_table", 1);
+    print_x2n("fcs16_x2n_table", FCS16_POLY, 16);
+
+    make_table(CRC8_POLY);
+    print_table("crc8_table", 1);
+
+    return 0;
+}
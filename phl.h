@@ -0,0 +1,434 @@
+#ifndef __PHL_H__
+#define __PHL_H__
+
+/*
+    Physical layer internals, shared by protocol.c and the backends built
+    beside it: loop_tick.c, loop_epoll.c, loop_uring.c, shm.c, bond.c,
+    phy_thread.c, engine.c and sim.c. The data link layer sees protocol.h
+    only. Include this first: it picks the platform headers.
+*/
+
+#ifndef	_CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU affinity of the engine shards */
+#endif
+
+#include <time.h>
+
+#ifdef _WIN32 /* for Windows Visual Studio */
+
+#include <winsock.h>
+#include <io.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/timeb.h>
+#include "getopt.h"
+
+#define getopt_long getopt_int
+#define stricmp _stricmp
+#define usleep(us) Sleep((DWORD)(((us) + 999) / 1000))
+#define THREAD_LOCAL __declspec(thread)
+
+#else /* for Linux */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/wait.h>
+#include <signal.h>
+#define stricmp strcasecmp
+#define Sleep(ms) usleep((ms) * 1000)
+/* a send() to a station that has quit fails with EPIPE instead of killing us */
+#define socket_init() signal(SIGPIPE, SIG_IGN)
+#define SOCKET int
+#define closesocket(s) close(s)
+#define THREAD_LOCAL __thread
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#define HAVE_EPOLL
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+#include <sys/eventfd.h>
+#include <linux/memfd.h>
+#define HAVE_SHM
+#include <pthread.h>
+#include <sched.h>
+#define HAVE_ENGINE
+#include <poll.h>
+#define HAVE_PHY_THREAD
+#endif
+
+#endif
+
+#include <math.h>
+
+#include "protocol.h"
+#include "timer.h"
+
+/* Clock */
+extern long long epoch_us;  /* the epoch to the microsecond, wall clock */
+extern long long mono_base; /* monotonic clock at the epoch, us */
+extern long long sim_us;    /* --sim: the virtual clock, -1: real time */
+
+extern long long mono_us(void);
+extern long long wall_us(void);
+extern void clock_init(void);
+
+/* channel parameters */
+#define CHAN_DELAY 270       /* ms */
+#define CHAN_BPS   8000      /* bits per second, default */
+
+#define ABORT(s) do { lprintf_quiet(0); lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+
+#define DEFAULT_TICK 15 /* ms */
+
+#define LOOP_TICK  0 /* poll with select(), then Sleep(mode_tick) */
+#define LOOP_EPOLL 1 /* sleep in epoll_wait() until the next deadline (timerfd) */
+#define LOOP_URING 2 /* io_uring: multishot recv, linked sends, timeout in io_uring_enter() */
+#define LOOP_SIM   3 /* --sim: both stations in one loop on a virtual clock */
+
+#define LINK_TCP  0 /* station B connects to 127.0.0.1 */
+#define LINK_UNIX 1 /* abstract-namespace AF_UNIX stream socket (Linux) */
+#define LINK_PAIR 2 /* station A forks station B, linked by socketpair() */
+
+#define BOND_MAX 8 /* channels of a station, one socket each */
+#define BOND_HDR 3 /* bonding: frame number, 16 bits, and a CRC-8 over it */
+
+/* Parameters */
+extern int mode_life, mode_tick, mode_seed, mode_fcs, mode_cut_through;
+extern int mode_rate[BOND_MAX], mode_bond, mode_pace, mode_link, mode_links, mode_cores;
+
+/* the data link layer, as handed to protocol_run() */
+extern int layer2_ctx_size;
+extern void (*layer2_init)(void *ctx);
+extern void (*layer2_handler)(void *ctx, int event, int arg);
+
+/*
+    Per-station state. A plain run has the one station0; an engine run
+    (--links) has two per link, and each shard thread points 'st' at
+    the station it is running at the moment. A simulation (--sim) has
+    the two of its one link.
+
+    What belongs to one line (socket, sending queue, pacer, delay line)
+    is a channel of the station: one, or --bond of them. 'ch' is the
+    channel being worked on, the station's first one outside of the
+    loops over all of them.
+*/
+
+#define SQ_SIZE  (128 * 1024) /* sending queue */
+#define DL_SPANS 4096         /* delay line spans in flight, a power of 2 */
+#define UR_BUFS  64           /* io_uring receive buffers, a power of 2 */
+
+struct SPAN {
+    long long commit_us;
+    unsigned int end; /* ring bytes before 'end' belong to this span or earlier ones */
+};
+
+struct SHARD;
+
+struct CHANNEL {
+    int nr;            /* channel number, 0 .. nchan - 1 */
+    SOCKET sock;
+    int bps;           /* line rate agreed by both stations */
+
+    /* shared memory link */
+    struct SHM_RING *shm_tx, *shm_rx;
+    int shm_tx_efd, shm_rx_efd;
+
+    /* sender */
+    unsigned char sq[SQ_SIZE];
+    int sq_head, sq_tail;
+    int sq_flight;     /* bytes before sq_head still owned by the kernel (io_uring) */
+    int tx_blocked;    /* nonblocking socket is full, wait for EPOLLOUT */
+
+    /* line pacer */
+    double tx_byte_us; /* us per line byte */
+    double tx_time;    /* due time of the next byte */
+    long long tx_last; /* time of the last release */
+    unsigned int tx_releases;
+    double tx_bytes, tx_late_sum, tx_late_sq, tx_late_max;
+    double tx_meas_us; /* us per line byte as measured between backlogged releases */
+    int tx_backlog;    /* bytes were left queued at the last release */
+    unsigned int tx_frames; /* frames sent on this channel */
+
+    /* delay line */
+    unsigned char *dl;
+    unsigned int dl_size, dl_mask;
+    unsigned int dl_head, dl_tail; /* free running, dl_tail - dl_head bytes in the ring */
+    struct SPAN dl_span[DL_SPANS];
+    unsigned int span_head, span_tail;
+    unsigned int dl_hwm, dl_span_hwm, dl_recvs;
+    double dl_bytes;
+
+    /* received frames: the one being assembled, and (bonding) those waiting to be put in order */
+    struct RCV_FRAME *rf_buf;
+    struct RCV_FRAME *bq_head, *bq_tail;
+
+#ifdef HAVE_EPOLL
+    int ep_fd;         /* sock, or the shared memory doorbell */
+    int ep_ready, ep_fresh; /* readiness from the last epoll_wait() */
+    int ep_events;     /* registered for ep_fd */
+#endif
+};
+
+struct STATION {
+    int station;       /* 'a' or 'b' */
+    int now;           /* timestamp (ms) */
+    long long now_us;  /* timestamp (us) */
+    int chan_bps;      /* line rate of all channels together */
+    unsigned long long seed; /* phl_rand() of an engine or --sim run */
+    int noise;         /* counter of bit errors */
+    unsigned int loop_syscalls; /* socket and event loop system calls */
+    unsigned int loop_frames;   /* frames sent and received */
+    unsigned int tx_frames;     /* frames sent */
+    unsigned int loop_wakeups;
+    int inform_phl_ready;
+    unsigned int nbits;
+
+    /* channels */
+    struct CHANNEL *chan[BOND_MAX];
+    int nchan;
+    struct CHANNEL chan0;
+
+    /* bonding: frames are numbered across the channels and put back in order on receipt */
+    unsigned short bond_tx_seq, bond_rx_seq, bond_rx_max;
+    long long bond_gap_us;  /* since when the frame bond_rx_seq is missing, 0: none */
+    long long bond_wait_us; /* how long a gap is waited for with a channel idle */
+    unsigned int bond_next_chan;
+    unsigned int bond_rx_frames, bond_reordered, bond_gaps, bond_hdr_errors;
+
+    /* timers */
+    struct timer_wheel *timers;
+    unsigned int timer_fires;
+    long long timer_late_max;
+    double timer_late_sum;
+
+    /* network layer */
+    int network_layer_active;
+    long long network_layer_us; /* last NETWORK_LAYER_READY */
+    int rpackets, rbytes;
+    int layer3_ready;
+    int ts0, last_ts;
+    int pkt_no;
+    unsigned int rand_a, rand_b; /* packet contents of station A and B */
+
+    /* received frames */
+    struct RCV_FRAME *rf_head, *rf_tail;
+    struct RCV_FRAME *rf_free;
+    int rf_hdr_len;    /* cut-through header of the frame being assembled */
+    int rf_hdr_ready;
+    unsigned char rf_hdr[64];
+    struct RCV_FRAME *rf_hdr_frame; /* the frame rf_hdr was taken from */
+
+#ifdef HAVE_EPOLL
+    int epfd, tfd;
+#endif
+
+#ifdef HAVE_IO_URING
+    int ur_fd;
+    unsigned int *ur_sq_head, *ur_sq_tail, *ur_sq_array, ur_sq_mask, ur_sq_entries;
+    unsigned int *ur_cq_head, *ur_cq_tail, ur_cq_mask, ur_cq_entries;
+    struct io_uring_sqe *ur_sqes;
+    struct io_uring_cqe *ur_cqes;
+    struct io_uring_buf_ring *ur_br;
+    unsigned char *ur_buf;
+    unsigned short ur_br_tail;
+    int ur_recv_armed;
+    unsigned int ur_to_submit;           /* SQEs queued since the last io_uring_enter() */
+    unsigned int ur_sends, ur_sends_new; /* sends not completed, of which not yet submitted */
+    struct io_uring_sqe *ur_last_send;   /* the next send queued is linked to this one */
+    /* reaped receive buffers not yet (fully) moved into the delay line, oldest first */
+    struct { int bid, len, off; } ur_rx[UR_BUFS];
+    unsigned int ur_rx_head, ur_rx_tail;
+#endif
+
+#ifdef HAVE_PHY_THREAD
+    struct PHY *phy;     /* --phy-thread: the thread running this station's channels */
+#endif
+
+    struct SHARD *shard; /* engine run: the shard thread running this station */
+    void *ctx;           /* engine run: the data link layer's context */
+    long long due;       /* engine run: next_deadline() after the last pass */
+};
+
+extern struct STATION station0;
+extern THREAD_LOCAL struct STATION *st;
+extern THREAD_LOCAL struct CHANNEL *ch;
+
+extern void channel_init(struct CHANNEL *c, int nr);
+extern void station_init(struct STATION *s);
+extern void station_enter(struct STATION *s);
+
+struct RCV_FRAME {
+    int len;
+    int state;
+    int header_sent; /* FRAME_HEADER raised for this frame */
+    int off;          /* bonding header bytes before the data link frame */
+    unsigned int fcs; /* FCS register over frame[off..len-1] */
+    unsigned char frame[2048];
+    struct RCV_FRAME *link;
+};
+
+#define PHL_SQ_LEVEL  50
+
+#ifdef HAVE_PHY_THREAD
+
+/* --phy-thread: the rings between the data link thread and the PHY thread, see phy_thread.c */
+
+#define PHY_TX_SIZE (256 * 1024) /* frames to send, as length-prefixed records, a power of 2 */
+#define PHY_MSGS    4096         /* entries of a message ring, a power of 2 */
+
+#define PHY_FRAME  0 /* a frame is in */
+#define PHY_HEADER 1 /* the header of a frame still on the line is in */
+#define PHY_CLOSED 2 /* the peer has gone */
+
+struct PHY_MSG {
+    struct RCV_FRAME *f;
+    int type;
+};
+
+struct PHY_RING {
+    unsigned int head;     /* consumer, free running */
+    char pad1[60];
+    unsigned int tail;     /* producer, free running */
+    char pad2[60];
+};
+
+struct PHY {
+    struct STATION station;    /* run by the PHY thread */
+
+    struct PHY_RING tx, rx, rel;
+    unsigned char tx_data[PHY_TX_SIZE];
+    struct PHY_MSG rx_msg[PHY_MSGS], rel_msg[PHY_MSGS];
+
+    /* PHY thread, for the data link layer's phl_sq_len() and timers */
+    int sq_len;                /* bytes on the line queue */
+    long long drain_us;        /* when they will have left it */
+    unsigned long long tx_taken; /* line bytes of the frames taken off the tx ring */
+    int closed;                /* 1: the peer has gone, 2: and the data link layer was told */
+    char pad3[64];
+
+    /* data link thread */
+    unsigned long long tx_given; /* line bytes of the frames put on the tx ring */
+    int dl_want_ready;         /* waits for PHYSICAL_LAYER_READY */
+    char pad4[64];
+
+    int dl_sleeping, phy_sleeping; /* waiting for dl_efd, phy_efd */
+    int dl_efd, phy_efd;
+    int stop;
+    int started;
+    pthread_t tid;
+    unsigned int frames_down, frames_up, dl_bells, phy_bells;
+};
+
+extern struct PHY phy0;
+
+#endif
+
+/* Physical layer, protocol.c */
+
+#define SOCK_RD 1
+#define SOCK_WR 2
+
+#define dl_pending() (ch->span_head != ch->span_tail)
+#define dl_commit_us() (ch->dl_span[ch->span_head % DL_SPANS].commit_us)
+#define dl_room() (ch->span_tail - ch->span_head < DL_SPANS ? ch->dl_size - (ch->dl_tail - ch->dl_head) : 0)
+
+extern void magic_check(void);
+#ifndef _WIN32
+extern int  pair_sock[BOND_MAX]; /* --transport=pair: this station's end of every channel */
+#endif
+extern void link_accept(void);
+extern void link_connect(void);
+extern void link_closed(void);
+extern int  sq_len(void);
+extern void pacer_init(void);
+extern long long pacer_drain_us(void);
+extern void delay_line_init(void);
+extern void dl_append(int n);
+extern long long next_deadline(void);
+extern long long rx_slack(struct STATION *s);
+extern void loop_init(void);
+extern void rf_queue(struct RCV_FRAME **head, struct RCV_FRAME **tail, struct RCV_FRAME *f);
+extern void chan_commit(void);
+extern void chan_io(void);
+extern int  phl_poll(int *arg);
+
+/* Event loops: loop_tick.c, loop_epoll.c, loop_uring.c */
+extern int  select_poll(void);
+extern void tick_sleep(void);
+#ifdef HAVE_EPOLL
+extern void epoll_init(void);
+extern void epoll_watch(int events);
+extern int  epoll_poll(void);
+extern void epoll_sleep(void);
+#endif
+#ifdef HAVE_IO_URING
+extern void uring_init(void);
+extern int  uring_send(const unsigned char *buf, int len);
+extern int  uring_poll(void);
+extern void uring_sleep(void);
+#endif
+
+/* Shared memory link, shm.c */
+#ifdef HAVE_SHM
+extern void shm_init(void);
+extern int  shm_send(const unsigned char *buf, int n);
+extern int  shm_recv(unsigned char *p1, unsigned int n1, unsigned char *p2, unsigned int n2);
+extern int  shm_rx_idle(int on);
+#endif
+
+/* Bonding, bond.c */
+extern void bond_rates(void);
+extern void bond_init(void);
+extern struct CHANNEL *bond_pick(int n);
+extern void bond_arrive(struct RCV_FRAME *f);
+extern void bond_reorder(void);
+extern void bond_report(void);
+
+/* PHY thread, phy_thread.c */
+#ifdef HAVE_PHY_THREAD
+extern void phy_init(void);
+extern void phy_start(void);
+extern void phy_send(const unsigned char *frame, int len);
+extern int  phy_sq_len(void);
+extern long long phy_drain_us(void);
+extern int  phy_tx_idle(int on);
+extern void phy_release(struct RCV_FRAME *f);
+extern void phy_collect(void);
+extern void phy_sleep(void);
+#endif
+
+/* Multi-link engine, engine.c */
+#ifdef HAVE_ENGINE
+extern void engine_run(void);
+#endif
+
+/* Discrete-event simulation, sim.c */
+extern int  sim_send(const unsigned char *buf, int n);
+extern void sim_run(void);
+
+#endif
@@ -0,0 +1,352 @@
+/*
+    With --phy-thread the channels of station0 (pacing, delay line,
+    noise, framing, bonding) are run by a thread of their own, on a copy
+    of the station; the data link layer keeps station0 for its timers,
+    network layer and received frames. Whole frames go down a byte ring
+    and come up as RCV_FRAMEs on a message ring, and go back on a third
+    once released. Every ring has one producer and one consumer. Each
+    side rings the other's eventfd only while that one says it sleeps.
+*/
+
+#include "phl.h"
+
+#ifdef HAVE_PHY_THREAD
+
+static int phy_put(struct PHY_RING *r, struct PHY_MSG *q, struct RCV_FRAME *f, int type)
+{
+    unsigned int tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == PHY_MSGS)
+        return 0;
+    q[tail & (PHY_MSGS - 1)].f = f;
+    q[tail & (PHY_MSGS - 1)].type = type;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int phy_get(struct PHY_RING *r, struct PHY_MSG *q, struct PHY_MSG *m)
+{
+    unsigned int head = r->head;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *m = q[head & (PHY_MSGS - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Wake the other thread if it says it sleeps */
+static void phy_doorbell(int *sleeping, int efd, unsigned int *bells)
+{
+    unsigned long long one = 1;
+
+    /* pairs with the fence in phy_sleep() and phy_tx_idle(); only the one that clears 'sleeping' rings */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(sleeping, 0, __ATOMIC_ACQ_REL))
+        return;
+    (*bells)++;
+    st->loop_syscalls++;
+    if (write(efd, &one, sizeof(one)) < 0)
+        ABORT("system write(eventfd)");
+}
+
+/* Line bytes send_frame() makes of a 'len'-byte frame */
+static unsigned long long phy_line_len(int len)
+{
+    return 2 * (len + (phy0.station.nchan > 1 ? BOND_HDR : 0)) + 2;
+}
+
+/* Data link thread: hand a frame to the PHY thread */
+void phy_send(const unsigned char *frame, int len)
+{
+    struct PHY *p = st->phy;
+    unsigned int tail = p->tx.tail, pos = tail & (PHY_TX_SIZE - 1), need = 4 + ((len + 3) & ~3), pad = 0;
+
+    /* a record never wraps: a length of -1 sends the reader back to the start */
+    if (PHY_TX_SIZE - pos < need)
+        pad = PHY_TX_SIZE - pos;
+    if (tail + pad + need - __atomic_load_n(&p->tx.head, __ATOMIC_ACQUIRE) > PHY_TX_SIZE)
+        ABORT("Physical Layer Sending Queue overflow");
+    if (pad) {
+        memset(p->tx_data + pos, 0xff, 4);
+        tail += pad;
+        pos = 0;
+    }
+    memcpy(p->tx_data + pos, &len, 4);
+    memcpy(p->tx_data + pos + 4, frame, len);
+    __atomic_store_n(&p->tx.tail, tail + need, __ATOMIC_RELEASE);
+
+    p->tx_given += phy_line_len(len);
+    p->frames_down++;
+    st->inform_phl_ready = 1;
+    phy_doorbell(&p->phy_sleeping, p->phy_efd, &p->phy_bells);
+}
+
+/* Data link thread: line bytes handed over and not yet on the PHY thread's line queue */
+static long long phy_pending(void)
+{
+    return (long long)(st->phy->tx_given - __atomic_load_n(&st->phy->tx_taken, __ATOMIC_ACQUIRE));
+}
+
+int phy_sq_len(void)
+{
+    long long pending = phy_pending();
+
+    return __atomic_load_n(&st->phy->sq_len, __ATOMIC_RELAXED) + (int)pending;
+}
+
+long long phy_drain_us(void)
+{
+    long long pending = phy_pending(), t = __atomic_load_n(&st->phy->drain_us, __ATOMIC_RELAXED);
+
+    return (t > st->now_us ? t - st->now_us : 0) + (long long)(pending * ch->tx_byte_us);
+}
+
+/* Data link thread: a frame goes back to the PHY thread once released */
+void phy_release(struct RCV_FRAME *f)
+{
+    if (!phy_put(&st->phy->rel, st->phy->rel_msg, f, PHY_FRAME)) {
+        /* the ring is full: park it here, never to be reused */
+        f->link = st->rf_free;
+        st->rf_free = f;
+    }
+}
+
+/* Data link thread: take what the PHY thread has in, in line order, up to a frame header */
+void phy_collect(void)
+{
+    struct PHY_MSG m;
+
+    while (phy_get(&st->phy->rx, st->phy->rx_msg, &m)) {
+        if (m.type == PHY_CLOSED) {
+            lprintf("TCP disconnected.\n");
+            exit(0);
+        }
+        if (m.type == PHY_HEADER) {
+            /* the header bytes stay put while the rest of the frame comes in */
+            memcpy(st->rf_hdr, m.f->frame + m.f->off, st->rf_hdr_len);
+            st->rf_hdr_ready = 1;
+            return;
+        }
+        if (st->ts0 == 0) {
+            st->ts0 = st->now;
+            if (st->ts0 >= m.f->len + 1)
+                st->ts0 -= m.f->len + 1;
+        }
+        rf_queue(&st->rf_head, &st->rf_tail, m.f);
+        st->phy->frames_up++;
+    }
+}
+
+/* Data link thread: sleep until a timer or the network layer is due, or the PHY thread rings */
+void phy_sleep(void)
+{
+    struct PHY *p = st->phy;
+    struct pollfd pfd;
+    struct timespec ts;
+    unsigned long long n;
+    long long us;
+
+    magic_check();
+
+    us = next_deadline() - get_us();
+    if (us <= 0)
+        return;
+
+    __atomic_store_n(&p->dl_want_ready, st->inform_phl_ready, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->dl_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->rx.tail, __ATOMIC_ACQUIRE) != p->rx.head ||
+        (st->inform_phl_ready && phy_sq_len() < PHL_SQ_LEVEL)) {
+        __atomic_store_n(&p->dl_sleeping, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    pfd.fd = p->dl_efd;
+    pfd.events = POLLIN;
+    ts.tv_sec = (time_t)(us / 1000000);
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    if (ppoll(&pfd, 1, &ts, NULL) < 0 && errno != EINTR)
+        ABORT("system ppoll()");
+    st->loop_syscalls++;
+    if (pfd.revents & POLLIN) {
+        if (read(p->dl_efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+            ABORT("system read(eventfd)");
+        st->loop_syscalls++;
+    }
+    __atomic_store_n(&p->dl_sleeping, 0, __ATOMIC_RELAXED);
+    st->loop_wakeups++;
+}
+
+/* PHY thread: before sleeping (on != 0) and after; returns nonzero if it has been handed work */
+int phy_tx_idle(int on)
+{
+    __atomic_store_n(&phy0.phy_sleeping, on, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&phy0.tx.tail, __ATOMIC_ACQUIRE) != phy0.tx.head ||
+        __atomic_load_n(&phy0.stop, __ATOMIC_RELAXED);
+}
+
+/* PHY thread: what the data link layer sees of the line queue */
+static void phy_publish(void)
+{
+    __atomic_store_n(&phy0.sq_len, phl_sq_len(), __ATOMIC_RELAXED);
+    __atomic_store_n(&phy0.drain_us, st->now_us + pacer_drain_us(), __ATOMIC_RELAXED);
+}
+
+/* PHY thread: released frames back on the free list, the frames handed over onto the line */
+static void phy_take(void)
+{
+    struct PHY_MSG m;
+    unsigned int head = phy0.tx.head, tail = __atomic_load_n(&phy0.tx.tail, __ATOMIC_ACQUIRE), pos;
+    unsigned long long taken = 0;
+    int len;
+
+    while (phy_get(&phy0.rel, phy0.rel_msg, &m)) {
+        m.f->link = st->rf_free;
+        st->rf_free = m.f;
+    }
+
+    if (head == tail)
+        return;
+    while (head != tail) {
+        pos = head & (PHY_TX_SIZE - 1);
+        memcpy(&len, phy0.tx_data + pos, 4);
+        if (len < 0) {
+            head += PHY_TX_SIZE - pos;
+            continue;
+        }
+        send_frame(phy0.tx_data + pos + 4, len);
+        head += 4 + ((len + 3) & ~3);
+        taken += phy_line_len(len);
+    }
+    __atomic_store_n(&phy0.tx.head, head, __ATOMIC_RELEASE);
+
+    /* the line queue first: a reader that sees the bytes taken sees them queued */
+    phy_publish();
+    __atomic_store_n(&phy0.tx_taken, phy0.tx_taken + taken, __ATOMIC_RELEASE);
+}
+
+/* PHY thread: frames and headers up to the data link thread, waking it for them or for the line */
+static void phy_give(void)
+{
+    struct RCV_FRAME *f, *next;
+    int n = 0;
+
+    while ((f = st->rf_head) != NULL) {
+        next = f->link;
+        f->link = NULL;
+        if (!phy_put(&phy0.rx, phy0.rx_msg, f, PHY_FRAME)) {
+            f->link = next;
+            break;
+        }
+        st->rf_head = next;
+        n++;
+    }
+
+    /* a header goes after the frames before it, the news of the peer after all of them */
+    if (st->rf_head == NULL) {
+        st->rf_tail = NULL;
+        if (st->rf_hdr_ready && phy_put(&phy0.rx, phy0.rx_msg, st->rf_hdr_frame, PHY_HEADER)) {
+            st->rf_hdr_ready = 0;
+            n++;
+        }
+        if (phy0.closed == 1 && !st->rf_hdr_ready && phy_put(&phy0.rx, phy0.rx_msg, NULL, PHY_CLOSED)) {
+            phy0.closed = 2;
+            n++;
+        }
+    }
+
+    phy_publish();
+    if (n || (__atomic_load_n(&phy0.dl_want_ready, __ATOMIC_RELAXED) && phy0.sq_len < PHL_SQ_LEVEL))
+        phy_doorbell(&phy0.dl_sleeping, phy0.dl_efd, &phy0.dl_bells);
+}
+
+static void *phy_main(void *arg)
+{
+    struct pollfd pfd;
+    unsigned long long n;
+
+    (void)arg;
+    station_enter(&phy0.station);
+
+    while (!__atomic_load_n(&phy0.stop, __ATOMIC_ACQUIRE)) {
+        st->now_us = get_us();
+        st->now = (int)(st->now_us / 1000);
+
+        phy_take();
+        /* a header not handed over yet holds the line back, as in phl_poll() */
+        if (!st->rf_hdr_ready)
+            chan_commit();
+        if (!phy0.closed)
+            chan_io();
+        phy_give();
+
+        if (phy0.closed == 2) { /* nothing left to do but wait for phy_stop() */
+            pfd.fd = phy0.phy_efd;
+            pfd.events = POLLIN;
+            if (!phy_tx_idle(1) && poll(&pfd, 1, -1) > 0 && read(phy0.phy_efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                ABORT("system read(eventfd)");
+            phy_tx_idle(0);
+        } else
+            epoll_sleep();
+    }
+    return NULL;
+}
+
+/* At exit: stop the PHY thread, the channel reports that follow are about its station */
+static void phy_stop(void)
+{
+    double secs = station0.now > 0 ? station0.now / 1000.0 : 1.0;
+
+    if (phy0.started && !pthread_equal(pthread_self(), phy0.tid)) {
+        __atomic_store_n(&phy0.stop, 1, __ATOMIC_RELEASE);
+        phy_doorbell(&phy0.phy_sleeping, phy0.phy_efd, &phy0.phy_bells);
+        pthread_join(phy0.tid, NULL);
+    }
+
+    lprintf("PHY thread: %u frames down, %u up, doorbells %u up, %u down\n",
+        phy0.frames_down, phy0.frames_up, phy0.dl_bells, phy0.phy_bells);
+    lprintf("Data link thread: %u wakeups (%.1f/s), %u timer expiries, late avg %.0f us, max %lld us\n",
+        station0.loop_wakeups, station0.loop_wakeups / secs, station0.timer_fires,
+        station0.timer_fires ? station0.timer_late_sum / station0.timer_fires : 0.0, station0.timer_late_max);
+    station_enter(&phy0.station);
+}
+
+/* Hand the channels of station0 over to a copy of it for the PHY thread, with its event loop */
+void phy_init(void)
+{
+    struct epoll_event ev;
+
+    phy0.station = *st;
+    phy0.station.chan[0] = &phy0.station.chan0;
+    station_enter(&phy0.station);
+
+    phy0.dl_efd = eventfd(0, EFD_NONBLOCK);
+    phy0.phy_efd = eventfd(0, EFD_NONBLOCK);
+    if (phy0.dl_efd < 0 || phy0.phy_efd < 0)
+        ABORT("system eventfd()");
+
+    loop_init();
+    ev.events = EPOLLIN;
+    ev.data.ptr = &phy0;
+    if (epoll_ctl(st->epfd, EPOLL_CTL_ADD, phy0.phy_efd, &ev) < 0)
+        ABORT("system epoll_ctl()");
+
+    /* station0 keeps its first channel, idle from now on */
+    station_enter(&station0);
+    st->nchan = 1;
+    st->phy = &phy0;
+    atexit(phy_stop);
+}
+
+/* First wait_for_event(): the data link layer has set up its end, e.g. phl_cut_through() */
+void phy_start(void)
+{
+    phy0.station.rf_hdr_len = st->rf_hdr_len;
+    if (pthread_create(&phy0.tid, NULL, phy_main, NULL) != 0)
+        ABORT("Failed to start the PHY thread");
+    phy0.started = 1;
+}
+
+#endif /* HAVE_PHY_THREAD */
@@ -1,23 +1,11 @@
-#ifndef	_CRT_SECURE_NO_WARNINGS
-#define _CRT_SECURE_NO_WARNINGS
-#endif
-
-#include <time.h>
+#include "phl.h"
 
 static time_t epoch; /* epoch timestamp (be same for Station A & B) */
+long long epoch_us; /* the epoch to the microsecond, wall clock */
+long long mono_base; /* monotonic clock at the epoch, us */
 
 #ifdef _WIN32 /* for Windows Visual Studio */
 
-#include <winsock.h>
-#include <io.h>
-#include <stdio.h>
-#include <sys/types.h>
-#include <sys/timeb.h>
-#include "getopt.h"
-
-#define getopt_long getopt_int
-#define stricmp _stricmp
-
 static void socket_init(void)
 {
     WORD wVersionRequested;
@@ -32,58 +20,71 @@ static void socket_init(void)
     }
 }
 
-unsigned int get_ms(void)
+long long mono_us(void)
+{
+	LARGE_INTEGER f, c;
+
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+
+	return c.QuadPart / f.QuadPart * 1000000 + c.QuadPart % f.QuadPart * 1000000 / f.QuadPart;
+}
+
+long long wall_us(void)
 {
 	struct _timeb tm;
 
 	_ftime(&tm);
 
-	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
+	return (long long)tm.time * 1000000 + tm.millitm * 1000;
 }
 
 #pragma comment(lib,"wsock32.lib")
 
 #else /* for Linux */
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <unistd.h>
-#include <ctype.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <getopt.h>
-#include <arpa/inet.h>
-#include <netinet/tcp.h>
-#include <netdb.h>
-#define stricmp strcasecmp
-#define Sleep(ms) usleep((ms) * 1000)
-#define socket_init()
-#define SOCKET int
+long long mono_us(void)
+{
+	struct timespec ts;
 
-unsigned int get_ms(void)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long wall_us(void)
 {
 	struct timeval tm;
-	struct timezone tz;
 
-	gettimeofday(&tm, &tz);
+	gettimeofday(&tm, NULL);
 
-	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
+	return (long long)tm.tv_sec * 1000000 + tm.tv_usec;
 }
 
 #endif
 
-#include <math.h>
+/* pin the shared epoch to the monotonic clock, wall clock steps do not move it later */
+void clock_init(void)
+{
+	epoch = (time_t)(epoch_us / 1000000);
+	mono_base = mono_us() - (wall_us() - epoch_us);
+}
 
-#include "protocol.h"
+long long sim_us = -1; /* --sim: the virtual clock, -1: real time */
 
-/* channel parameters */
-#define CHAN_DELAY 270       /* ms */
-#define CHAN_BPS   8000      /* bits per second */
+/* microseconds since the epoch, 0 before protocol_init() has set it */
+long long get_us(void)
+{
+	if (sim_us >= 0)
+		return sim_us;
+	return epoch ? mono_us() - mono_base : 0;
+}
 
-#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+unsigned int get_ms(void)
+{
+	return (unsigned int)(get_us() / 1000);
+}
 
-#define DEFAULT_TICK 15 /* ms */
 #define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
 #define DEFAULT_PORT  59144
 
@@ -92,29 +93,104 @@ unsigned int get_ms(void)
 #define FOOT_MAGIC 0xf5125a5a
 
 static void magic_init(void);
-static void magic_check(void);
+static void delay_line_report(void);
+static void pacer_report(void);
+static void loop_report(void);
 
 static unsigned int head_magic[NMAGIC];
 
 /* Parameters */
-static int station;
 static double ber = DEFAULT_CHAN_BER;  /* Bit Error Rate */
 static int mode_ibib = 0;    /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
 static int mode_flood = 0;   /* flood mode */
 static int mode_cycle = 100;  /* seconds */
-static int mode_life = 0x7fffff00;
-static int mode_tick = DEFAULT_TICK;
-static int mode_seed = 0x098bcde1;
+int mode_life = 0x7fffff00;
+int mode_tick = DEFAULT_TICK;
+int mode_seed = 0x098bcde1;
 static int debug_mask = 0; /* debug mask */
+int mode_fcs = -1;  /* frame check sequence asked for, -1: no preference */
+int mode_cut_through = 0; /* early FRAME_HEADER events, on if either station asks */
+static int mode_loop = LOOP_TICK; /* event loop, LOOP_TICK, LOOP_EPOLL, LOOP_URING or LOOP_SIM */
+int mode_rate[BOND_MAX]; /* line rate asked for per channel (bps), 0: no preference */
+int mode_bond = 1;  /* channels a station stripes its frames over */
+int mode_pace = 0;  /* us between line pacer wakeups (epoll loop), 0: one per TX_QUANTUM */
+int mode_link = LINK_TCP; /* transport between the stations */
+static int mode_shm = 0;   /* line bytes over shared memory rings, on if either station asks */
 static unsigned short port = DEFAULT_PORT;
+int mode_links = 0; /* engine run: station pairs in this process, 0: one station */
+int mode_cores = 0; /* engine run: shard threads */
+static int mode_phy = 0;   /* channel emulation on a thread of its own */
+static int mode_sim = 0;   /* discrete-event simulation of both stations, on a virtual clock */
+
+/* the data link layer, as handed to protocol_run() */
+int layer2_ctx_size;
+void (*layer2_init)(void *ctx);
+void (*layer2_handler)(void *ctx, int event, int arg);
+
+struct STATION station0;
+THREAD_LOCAL struct STATION *st = &station0;
+THREAD_LOCAL struct CHANNEL *ch = &station0.chan0;
+
+#ifdef HAVE_PHY_THREAD
+struct PHY phy0;
+#endif
+
+void channel_init(struct CHANNEL *c, int nr)
+{
+    memset(c, 0, sizeof(*c));
+    c->nr = nr;
+    c->bps = CHAN_BPS;
+    c->shm_tx_efd = c->shm_rx_efd = -1;
+#ifdef HAVE_EPOLL
+    c->ep_fd = -1;
+    c->ep_events = EPOLLIN;
+#endif
+}
+
+void station_init(struct STATION *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->chan_bps = CHAN_BPS;
+    s->inform_phl_ready = 1;
+    s->rand_a = 0x65109bc4;
+    s->rand_b = 0x1e459090;
+    channel_init(&s->chan0, 0);
+    s->chan[0] = &s->chan0;
+    s->nchan = 1;
+#ifdef HAVE_EPOLL
+    s->epfd = s->tfd = -1;
+#endif
+#ifdef HAVE_IO_URING
+    s->ur_fd = -1;
+#endif
+}
 
-static SOCKET sock;
-static int now; /* timestamp (ms) */
-static int noise = 0; /* counter of bit errors */
+/* Make station 's' the current one, at its first channel */
+void station_enter(struct STATION *s)
+{
+    st = s;
+    ch = s->chan[0];
+}
+
+/*
+    Noise and station B's pacing. A station alone in its process draws
+    from rand(), seeded by --seed as it always was; the stations of an
+    engine or --sim run share the process, so each has a generator of its
+    own.
+*/
+#define PHL_RAND_MAX (mode_links || mode_sim ? 0x7fffffff : RAND_MAX)
+
+static int phl_rand(void)
+{
+    if (!mode_links && !mode_sim)
+        return rand();
+    st->seed = st->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (int)(st->seed >> 33);
+}
 
 char *station_name(void)
 {
-    return (char *)(station == 'a' ? "A" : station == 'b' ? "B" : "XXX");
+    return (char *)(st->station == 'a' ? "A" : st->station == 'b' ? "B" : "XXX");
 }
 
 static struct option intopts[] = {
@@ -128,10 +204,72 @@ static struct option intopts[] = {
 	{ "ber",	required_argument, NULL, 'b' },
 	{ "log",	required_argument, NULL, 'l' },
 	{ "ttl",    required_argument, NULL, 't' },
+	{ "fcs",    required_argument, NULL, 'c' },
+	{ "cut-through", no_argument, NULL, 'x' },
+	{ "loop",   required_argument, NULL, 'L' },
+	{ "rate",   required_argument, NULL, 'r' },
+	{ "pace",   required_argument, NULL, 'P' },
+	{ "transport", required_argument, NULL, 'T' },
+	{ "shm",    no_argument, NULL, 'S' },
+	{ "links",  required_argument, NULL, 'N' },
+	{ "cores",  required_argument, NULL, 'C' },
+	{ "bond",   required_argument, NULL, 'K' },
+	{ "phy-thread", no_argument, NULL, 'H' },
+	{ "sim",    no_argument, NULL, 'V' },
+	{ "seed",   required_argument, NULL, 's' },
 	{ 0, 0, 0, 0 },
 };
 
-#define OPT_SHORT "?ufind:p:b:l:t:"
+#ifndef _WIN32
+static pid_t pair_pid;
+int pair_sock[BOND_MAX]; /* this station's end of every channel */
+
+/* Station A waits for station B; B quits by itself at the end of its time to live */
+static void pair_wait(void)
+{
+    int i;
+
+    if (st->now <= mode_life) {
+        for (i = 0; i < st->nchan; i++)
+            shutdown(st->chan[i]->sock, SHUT_RDWR);
+    }
+    waitpid(pair_pid, NULL, 0);
+}
+
+/* Fork station B on the other end of a socketpair() per channel, returns the station name of this process */
+static int pair_fork(void)
+{
+    int sv[BOND_MAX][2], i;
+
+    for (i = 0; i < mode_bond; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0)
+            ABORT("system socketpair()");
+    }
+
+    fflush(stdout);
+    pair_pid = fork();
+    if (pair_pid < 0)
+        ABORT("system fork()");
+
+    for (i = 0; i < mode_bond; i++) {
+        close(sv[i][pair_pid == 0 ? 0 : 1]);
+        pair_sock[i] = sv[i][pair_pid == 0 ? 1 : 0];
+    }
+    ch->sock = pair_sock[0];
+
+    if (pair_pid == 0) {
+        /* the console is station A's */
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            ABORT("system freopen()");
+        return 'b';
+    }
+
+    atexit(pair_wait);
+    return 'a';
+}
+#endif
+
+#define OPT_SHORT "?ufinxSHVd:p:b:l:t:c:L:r:P:T:N:C:K:s:"
 
 static void config(int argc, char **argv)
 {
@@ -153,12 +291,36 @@ static void config(int argc, char **argv)
 			"    -b, --ber=<ber> : Bit Error Rate (received data only)\n"
 			"    -l, --log=<filename> : using assigned file as log file\n"
 			"    -t, --ttl=<seconds> : set time-to-live\n"
+			"    -c, --fcs=<crc32|crc32c|fcs16|fcs32> : frame check sequence (default: crc32)\n"
+			"    -x, --cut-through : report frame headers before the whole frame is in\n"
+			"    -L, --loop=<tick|epoll|uring> : event loop (default: tick)\n"
+			"    -r, --rate=<bps>[,<bps>...] : line rate (default: %u), one per --bond\n"
+			"        channel, the last one given repeating\n"
+			"    -P, --pace=<us> : release line bytes every <us> us (epoll/uring loop)\n"
+			"    -T, --transport=<tcp|unix|pair> : link between the stations (default: tcp);\n"
+			"        unix: abstract AF_UNIX socket named after the port number,\n"
+			"        pair: run both stations from one command, B logging to its file only\n"
+			"    -S, --shm : line bytes over shared memory rings (unix or pair transport)\n"
+			"    -N, --links=<n> : run <n> station pairs in this process, no station name\n"
+			"    -C, --cores=<n> : shard threads for --links, each with its own event loop\n"
+			"        (default: one per CPU)\n"
+			"    -K, --bond=<n> : stripe the frames over <n> channels, TCP port <port#>,\n"
+			"        <port#>+1, ...; both stations have to ask for the same <n>\n"
+			"    -H, --phy-thread : emulate the channel (pacing, delay, noise, framing) on\n"
+			"        a thread of its own, with the epoll loop\n"
+			"    -V, --sim : run both stations in this process on a virtual clock, no\n"
+			"        station name; as fast as the CPU allows (default ttl: 600 s)\n"
+			"    -s, --seed=<n> : noise and pacing seed, the same one repeats a --sim run\n"
 			"\n"
 			"i.e.\n"
 			"    %s -fd3 -b 1e-4 A\n"
 			"    %s --flood --debug=3 --ber=1e-4 A\n"
+			"    %s --transport=pair --flood\n"
+			"    %s --links=200 --cores=4 --flood --nolog\n"
+			"    %s --bond=3 --rate=8000,8000,16000 --flood A\n"
+			"    %s --sim --seed=7 --ttl=3600 -b 1e-4\n"
 			"\n",
-			DEFAULT_PORT, argv[0], argv[0]);
+			DEFAULT_PORT, CHAN_BPS, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
 		exit(0);
 	}
 
@@ -185,6 +347,57 @@ static void config(int argc, char **argv)
 			strcpy(fname, "nul");
 			break;
 
+		case 'x':
+			mode_cut_through = 1;
+			break;
+
+		case 'S':
+#ifdef HAVE_SHM
+			mode_shm = 1;
+			break;
+#else
+			printf("Shared memory rings are not supported on this system\n");
+			goto usage;
+#endif
+
+		case 'H':
+#ifdef HAVE_PHY_THREAD
+			mode_phy = 1;
+			break;
+#else
+			printf("A PHY thread is not supported on this system\n");
+			goto usage;
+#endif
+
+		case 'N':
+#ifdef HAVE_ENGINE
+			mode_links = atoi(optarg);
+			if (mode_links < 1 || mode_links > 100000) {
+				printf("Bad number of links %s\n", optarg);
+				goto usage;
+			}
+			break;
+#else
+			printf("Multi-link runs are not supported on this system\n");
+			goto usage;
+#endif
+
+		case 'V':
+			mode_sim = 1;
+			break;
+
+		case 's':
+			mode_seed = (int)strtoul(optarg, NULL, 0);
+			break;
+
+		case 'C':
+			mode_cores = atoi(optarg);
+			if (mode_cores < 1 || mode_cores > 1024) {
+				printf("Bad number of cores %s\n", optarg);
+				goto usage;
+			}
+			break;
+
 		case 'd':
 			debug_mask = atoi(optarg);
 			break;
@@ -209,24 +422,156 @@ static void config(int argc, char **argv)
 			mode_life = atoi(optarg) * 1000; /* ms */
 			break;
 
+		case 'c':
+			mode_fcs = fcs_lookup(optarg);
+			if (mode_fcs < 0) {
+				printf("Bad frame check sequence \"%s\"\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'r': {
+			char *p = optarg;
+			int i;
+
+			for (i = 0; i < BOND_MAX; i++) {
+				mode_rate[i] = p ? atoi(p) : mode_rate[i - 1];
+				if (mode_rate[i] < 800 || mode_rate[i] > 1000000000) {
+					printf("Bad line rate %s\n", optarg);
+					goto usage;
+				}
+				if (p && (p = strchr(p, ',')) != NULL)
+					p++;
+			}
+			if (p) {
+				printf("More than %d line rates %s\n", BOND_MAX, optarg);
+				goto usage;
+			}
+			break;
+		}
+
+		case 'K':
+			mode_bond = atoi(optarg);
+			if (mode_bond < 1 || mode_bond > BOND_MAX) {
+				printf("Bad number of channels %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'P':
+			mode_pace = atoi(optarg);
+			if (mode_pace < 10 || mode_pace > 1000000) {
+				printf("Bad pacing interval %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'T':
+			if (stricmp(optarg, "tcp") == 0)
+				mode_link = LINK_TCP;
+#ifdef __linux__
+			else if (stricmp(optarg, "unix") == 0)
+				mode_link = LINK_UNIX;
+#endif
+#ifndef _WIN32
+			else if (stricmp(optarg, "pair") == 0)
+				mode_link = LINK_PAIR;
+#endif
+			else {
+				printf("Bad transport \"%s\"\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'L':
+			if (stricmp(optarg, "tick") == 0)
+				mode_loop = LOOP_TICK;
+#ifdef HAVE_EPOLL
+			else if (stricmp(optarg, "epoll") == 0)
+				mode_loop = LOOP_EPOLL;
+#endif
+#ifdef HAVE_IO_URING
+			else if (stricmp(optarg, "uring") == 0)
+				mode_loop = LOOP_URING;
+#endif
+			else {
+				printf("Bad event loop \"%s\"\n", optarg);
+				goto usage;
+			}
+			break;
+
 		default:
 			printf("ERROR: Unsupported option\n");
 			goto usage;
 		}
 	}
 
-	if (optind == argc) 
+	if (mode_bond > 1 && (mode_links || mode_shm || mode_loop == LOOP_URING)) {
+		printf("--bond runs one station pair over sockets with the tick or epoll loop\n");
 		goto usage;
+	}
 
-	station = tolower(argv[optind++][0]);
-	if (station != 'a' && station != 'b')
-		ABORT("Station name must be 'A' or 'B'");
+	if (mode_phy) {
+		if (mode_links || mode_loop == LOOP_URING) {
+			printf("--phy-thread runs one station pair with the epoll loop\n");
+			goto usage;
+		}
+		mode_loop = LOOP_EPOLL;
+	}
+
+	if (mode_sim) {
+		/* no sockets: the line bytes go straight into the peer's delay line */
+		if (mode_links || mode_phy || mode_shm || mode_link != LINK_TCP || mode_loop == LOOP_URING) {
+			printf("--sim runs one station pair on its own, without --links, --phy-thread, --shm or --transport\n");
+			goto usage;
+		}
+		mode_loop = LOOP_SIM;
+		if (mode_life == 0x7fffff00)
+			mode_life = 600 * 1000;
+	} else
+#ifdef HAVE_ENGINE
+	if (mode_links) {
+		/* the shards link their stations with socketpair() and run their own epoll loops */
+		if (mode_link != LINK_TCP || mode_shm || mode_loop == LOOP_URING) {
+			printf("--links runs the stations of a link over a socketpair with the epoll loop\n");
+			goto usage;
+		}
+		mode_loop = LOOP_EPOLL;
+		if (mode_cores == 0)
+			mode_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (mode_cores > mode_links)
+			mode_cores = mode_links;
+		if (mode_cores < 1)
+			mode_cores = 1;
+	} else
+#endif
+#ifndef _WIN32
+	if (mode_link == LINK_PAIR)
+		st->station = pair_fork();
+	else
+#endif
+	{
+		if (optind == argc) 
+			goto usage;
+
+		st->station = tolower(argv[optind++][0]);
+		if (st->station != 'a' && st->station != 'b')
+			ABORT("Station name must be 'A' or 'B'");
+	}
 
 	if (fname[0] == 0) {
 		strcpy(fname, argv[0]);
 		if (stricmp(fname + strlen(fname) - 4, ".exe") == 0)
 			*(fname + strlen(fname) - 4) = 0;
-		strcat(fname, station == 'a' ? "-A.log" : "-B.log");
+		strcat(fname, mode_sim ? "-sim.log" : mode_links ? "-links.log" : st->station == 'a' ? "-A.log" : "-B.log");
+	} else if (mode_link == LINK_PAIR && stricmp(fname, "nul") != 0) {
+		/* one name given for both stations: x.log becomes x-A.log and x-B.log */
+		char *ext = strrchr(fname, '.'), tail[1024];
+
+		if (ext == NULL || strchr(ext, '/'))
+			ext = fname + strlen(fname);
+		strcpy(tail, ext);
+		sprintf(ext, "-%c%s", toupper(st->station), tail);
 	}
 
 	if (stricmp(fname, "nul") == 0)
@@ -234,14 +579,26 @@ static void config(int argc, char **argv)
 	else if ((log_file = fopen(fname, "w")) == NULL) 
 		printf("WARNING: Failed to create log file \"%s\": %s\n", fname, strerror(errno));
 
-	lprintf(
-		"=============================================================\n"
-		"                    Station %s                               \n"
-		"-------------------------------------------------------------\n",
-		station_name());
+	if (mode_links)
+		lprintf(
+			"=============================================================\n"
+			"                    %d links on %d cores                     \n"
+			"-------------------------------------------------------------\n",
+			mode_links, mode_cores);
+	else if (mode_sim)
+		lprintf(
+			"=============================================================\n"
+			"              Station A and B, simulated                     \n"
+			"-------------------------------------------------------------\n");
+	else
+		lprintf(
+			"=============================================================\n"
+			"                    Station %s                               \n"
+			"-------------------------------------------------------------\n",
+			station_name());
 
 	lprintf("Protocol.lib, version %s, jiangyanjun0718@bupt.edu.cn\n", VERSION, __DATE__);
-	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", CHAN_BPS, CHAN_DELAY);
+	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", mode_rate[0] ? mode_rate[0] : CHAN_BPS, CHAN_DELAY);
 	if (ber > 0.0)
 		lprintf("%.1E\n", ber);
 	else
@@ -251,75 +608,310 @@ static void config(int argc, char **argv)
 
 /* Create Communication Sockets  */
 
+union LINK_ADDR {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+#ifdef __linux__
+    struct sockaddr_un un;
+#endif
+};
+
+/* Address station A listens on and station B connects to for channel 'ch', returns its length */
+static int link_addr(union LINK_ADDR *addr, char *desc)
+{
+    unsigned int chan_port = port + ch->nr;
+
+    memset(addr, 0, sizeof(*addr));
+
+#ifdef __linux__
+    if (mode_link == LINK_UNIX) {
+        int n;
+
+        /* abstract namespace: a leading 0, no file to clean up */
+        addr->un.sun_family = AF_UNIX;
+        n = sprintf(addr->un.sun_path + 1, "datalink-%u", chan_port);
+        sprintf(desc, "UNIX socket @%s", addr->un.sun_path + 1);
+        return (int)offsetof(struct sockaddr_un, sun_path) + 1 + n;
+    }
+#endif
+
+    addr->in.sin_family = AF_INET;
+    addr->in.sin_addr.s_addr = st->station == 'a' ? INADDR_ANY : inet_addr("127.0.0.1");
+    addr->in.sin_port = htons((short)chan_port);
+    sprintf(desc, "TCP port %u", chan_port);
+    return (int)sizeof(addr->in);
+}
+
+/*
+    Startup handshake: B sends one HELLO with its epoch and preferences,
+    A answers with the agreed settings and a status. Both sides check the
+    magic and version before trusting anything else in it.
+*/
+#define HELLO_MAGIC   0x444c4e4b /* "DLNK" */
+#define HELLO_VERSION 2
+
+#define HELLO_CUT_THROUGH 0x01
+#define HELLO_SHM         0x02
+
+enum { HELLO_OK, HELLO_BAD_VERSION, HELLO_FCS_CONFLICT, HELLO_RATE_CONFLICT, HELLO_BOND_CONFLICT };
+
+struct HELLO {
+    unsigned int magic, version;
+    long long epoch_us;        /* wall clock at B's connect, us */
+    int fcs;                   /* -1: no preference */
+    int bond;                  /* channels, the same on both stations */
+    int rate[BOND_MAX];        /* line rate of every channel, 0: no preference */
+    unsigned int features;     /* HELLO_xxx, OR of both stations */
+    int status;                /* A's answer, HELLO_OK or why it refused */
+};
+
+/* read exactly 'len' bytes, 0 if the peer went away first */
+static int link_read(void *buf, int len)
+{
+    int n, got = 0;
+
+    while (got < len) {
+        n = recv(ch->sock, (char *)buf + got, len - got, 0);
+        if (n <= 0)
+            return 0;
+        got += n;
+    }
+    return 1;
+}
+
+static void hello_refuse(struct HELLO *h, int status)
+{
+    h->status = status;
+    send(ch->sock, (char *)h, sizeof(*h), 0);
+}
+
+static void hello_a(void)
+{
+    struct HELLO h;
+    int i;
+
+    if (!link_read(&h, sizeof(h)) || h.magic != HELLO_MAGIC)
+        ABORT("Station A got no handshake from station B");
+
+    h.magic = HELLO_MAGIC;
+    if (h.version != HELLO_VERSION) {
+        h.version = HELLO_VERSION;
+        hello_refuse(&h, HELLO_BAD_VERSION);
+        ABORT("Station B speaks a different handshake version");
+    }
+
+    epoch_us = h.epoch_us;
+    clock_init();
+
+    /* FCS: A's choice, else B's, else CRC-32 */
+    if (mode_fcs >= 0 && h.fcs >= 0 && mode_fcs != h.fcs) {
+        hello_refuse(&h, HELLO_FCS_CONFLICT);
+        ABORT("Station A and B asked for different frame check sequences");
+    }
+    if (mode_fcs < 0)
+        mode_fcs = h.fcs >= 0 ? h.fcs : FCS_CRC32;
+
+    /* channels: no default, a station bonds only with one that knows it does */
+    if (h.bond != mode_bond) {
+        hello_refuse(&h, HELLO_BOND_CONFLICT);
+        ABORT("Station A and B asked for different numbers of channels");
+    }
+
+    /* line rate of every channel: as the FCS */
+    for (i = 0; i < mode_bond; i++) {
+        if (mode_rate[i] && h.rate[i] && mode_rate[i] != h.rate[i]) {
+            hello_refuse(&h, HELLO_RATE_CONFLICT);
+            ABORT("Station A and B asked for different line rates");
+        }
+        if (mode_rate[i] == 0)
+            mode_rate[i] = h.rate[i] ? h.rate[i] : CHAN_BPS;
+        h.rate[i] = mode_rate[i];
+    }
+
+    mode_cut_through |= (h.features & HELLO_CUT_THROUGH) != 0;
+    mode_shm |= (h.features & HELLO_SHM) != 0;
+
+    h.fcs = mode_fcs;
+    h.features = (mode_cut_through ? HELLO_CUT_THROUGH : 0) | (mode_shm ? HELLO_SHM : 0);
+    h.status = HELLO_OK;
+    send(ch->sock, (char *)&h, sizeof(h), 0);
+}
+
+static void hello_b(void)
+{
+    struct HELLO h;
+    int i;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = HELLO_MAGIC;
+    h.version = HELLO_VERSION;
+    h.epoch_us = epoch_us = wall_us();
+    h.fcs = mode_fcs;
+    h.bond = mode_bond;
+    memcpy(h.rate, mode_rate, sizeof(h.rate));
+    h.features = (mode_cut_through ? HELLO_CUT_THROUGH : 0) | (mode_shm ? HELLO_SHM : 0);
+    clock_init();
+
+    send(ch->sock, (char *)&h, sizeof(h), 0);
+    if (!link_read(&h, sizeof(h)) || h.magic != HELLO_MAGIC)
+        ABORT("Station B got no handshake from station A");
+
+    switch (h.status) {
+    case HELLO_OK:
+        break;
+    case HELLO_BAD_VERSION:
+        ABORT("Station A speaks a different handshake version");
+    case HELLO_FCS_CONFLICT:
+        ABORT("Station A and B asked for different frame check sequences");
+    case HELLO_RATE_CONFLICT:
+        ABORT("Station A and B asked for different line rates");
+    case HELLO_BOND_CONFLICT:
+        ABORT("Station A and B asked for different numbers of channels");
+    default:
+        ABORT("Station A refused the handshake");
+    }
+    if (!fcs_select(h.fcs))
+        ABORT("Station A sent a bad handshake");
+    for (i = 0; i < mode_bond; i++) {
+        if (h.rate[i] <= 0)
+            ABORT("Station A sent a bad handshake");
+        mode_rate[i] = h.rate[i];
+    }
+
+    mode_fcs = h.fcs;
+    mode_cut_through = (h.features & HELLO_CUT_THROUGH) != 0;
+    mode_shm = (h.features & HELLO_SHM) != 0;
+}
+
+/* Station A: wait for station B to connect channel 'ch' */
+void link_accept(void)
+{
+    SOCKET admin_sock;
+    union LINK_ADDR name;
+    char desc[64];
+    int len;
+
+    len = link_addr(&name, desc);
+
+    admin_sock = socket(name.sa.sa_family, SOCK_STREAM, 0);
+    if (admin_sock < 0) 
+        ABORT("Create TCP socket");
+    /* a relaunch must not wait out the last run's TIME_WAIT */
+    if (mode_link == LINK_TCP) {
+        int on = 1;
+
+        setsockopt(admin_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    }
+    if (bind(admin_sock, &name.sa, len) < 0) {
+        lprintf("Station A: Failed to bind %s", desc);
+        ABORT("Station A failed to bind TCP port");
+    }
+
+    listen(admin_sock, 5);
+
+    lprintf("Station A is waiting for station B on %s ... ", desc);
+    fflush(stdout);
+
+    ch->sock = accept(admin_sock, 0, 0);
+    if (ch->sock < 0) 
+        ABORT("Station A failed to communicate with station B");
+    closesocket(admin_sock);
+    lprintf("Done.\n");
+}
+
+/*
+    Connect to station A, which may not be listening yet: retry on a fresh
+    socket, backing off from 100 us to 10 ms, for up to two minutes.
+*/
+void link_connect(void)
+{
+    union LINK_ADDR name;
+    char desc[64];
+    long long t0 = mono_us(), backoff = 100;
+    int len, retries = 0;
+
+    len = link_addr(&name, desc);
+
+    lprintf("Station B is connecting station A (%s) ... ", desc);
+    fflush(stdout);
+
+    for (;;) {
+        ch->sock = socket(name.sa.sa_family, SOCK_STREAM, 0);
+        if (ch->sock < 0) 
+            ABORT("Create TCP socket");
+        if (connect(ch->sock, &name.sa, len) == 0)
+            break;
+        closesocket(ch->sock);
+
+        if (mono_us() - t0 > 120 * 1000000LL) {
+            lprintf("Failed!\n");
+            ABORT("Station B failed to connect station A");
+        }
+        usleep((unsigned)backoff);
+        retries++;
+        if (backoff < 10000)
+            backoff *= 2;
+    }
+
+    lprintf("Done (%d retries, %.1f ms).\n", retries, (mono_us() - t0) / 1000.0);
+}
+
 void protocol_init(int argc, char **argv)
 {
-	SOCKET admin_sock;
 	int i;
-    struct sockaddr_in name;
 
+	station_init(&station0);
 	socket_init();
 	magic_init();
 
 	config(argc, argv);
+
+    if (mode_links || mode_sim) {
+        if (layer2_handler == NULL)
+            ABORT("--links/--sim: the data link layer has to be started by protocol_run()");
+        return;
+    }
   
-    if (station == 'a') {
+    if (st->station == 'a') {
 
         srand(mode_seed ^ 97209);
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = INADDR_ANY;
-        name.sin_port = htons(port);
+        if (mode_link != LINK_PAIR)
+            link_accept();
 
-        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (admin_sock < 0) 
-            ABORT("Create TCP socket");
-        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-            lprintf("Station A: Failed to bind TCP port %u", port);
-            ABORT("Station A failed to bind TCP port");
-        }
+        hello_a();
+    }
 
-        listen(admin_sock, 5);
+    if (st->station == 'b') {
 
-        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
-        fflush(stdout);
+        srand(mode_seed ^ 18231);
 
-        sock = accept(admin_sock, 0, 0);
-        if (sock < 0) 
-            ABORT("Station A failed to communicate with station B");
-        lprintf("Done.\n");
+        if (mode_link != LINK_PAIR)
+            link_connect();
 
-        recv(sock, (char *)&epoch, sizeof(epoch), 0);
+        hello_b();
     }
 
-    if (station == 'b') {
-
-        srand(mode_seed ^ 18231);
-
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) 
-            ABORT("Create TCP socket");
+    if (mode_shm) {
+#ifdef HAVE_SHM
+        if (mode_link == LINK_TCP)
+            ABORT("Shared memory rings need the unix or pair transport");
+        shm_init();
+#else
+        ABORT("Shared memory rings are not supported on this system");
+#endif
+    }
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = inet_addr("127.0.0.1");
-        name.sin_port = htons((short)port);
-
-        for (i = 0; i < 60; i++) {
-            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
-            fflush(stdout);
-
-            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
-                lprintf("Failed!\n");
-                Sleep(2000);
-            } else {
-                lprintf("Done.\n");
-                break;
-            }
-        }
-        if (i == 6)
-            ABORT("Station B failed to connect station A");
+    bond_init();
 
-        time(&epoch);
-        send(sock, (char *)&epoch, sizeof(epoch), 0);
+    fcs_select(mode_fcs);
+    lprintf("Line rate %d bps, frame check sequence: %s%s%s\n", st->chan_bps, fcs_name(fcs_type()),
+        mode_cut_through ? ", cut-through" : "", mode_shm ? ", shared memory rings" : "");
+    if (st->nchan > 1) {
+        lprintf("Bonding: %d channels of", st->nchan);
+        for (i = 0; i < st->nchan; i++)
+            lprintf("%s %d", i ? " +" : "", st->chan[i]->bps);
+        lprintf(" bps\n");
     }
 
     {
@@ -329,335 +921,800 @@ void protocol_init(int argc, char **argv)
         lprintf("=================================================================\n\n");
     }
 
-    /* socket options */
-    {
+    /* socket options, line pacer and delay line of every channel */
+    for (i = 0; i < st->nchan; i++) {
         int timeout_ms = 10; 
         int buf_size = 1024 * 64;
         int on = 1;
 
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
+        ch = st->chan[i];
+        setsockopt(ch->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
+        setsockopt(ch->sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
 
-        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(ch->sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(ch->sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
 
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
+        if (mode_link == LINK_TCP)
+            setsockopt(ch->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
+
+        delay_line_init();
+        pacer_init();
     }   
+    ch = st->chan[0];
+
+    atexit(delay_line_report);
+    atexit(pacer_report);
+    atexit(loop_report);
+    if (st->nchan > 1)
+        atexit(bond_report);
+#ifdef HAVE_PHY_THREAD
+    if (mode_phy)
+        phy_init();
+    else
+#endif
+    loop_init();
 
     get_ms();
 }
 
-/* Physical Layer: Sender */
+/* Physical Layer: Line Codec */
 
-/* Sending queue structure */
+/*
+    Every frame byte goes on the line as two bytes, low nibble first, and
+    frames are delimited by 0xff. The receiver keeps whatever noise hit the
+    high bits of the first byte of a pair: a | ((b << 4 ^ b) & 0xf0).
+*/
+
+static void nibble_encode_c(unsigned char *out, const unsigned char *in, int len)
+{
+    int i;
 
-#define SQ_SIZE (128 * 1024) 
+    for (i = 0; i < len; i++) {
+        out[2 * i] = in[i] & 0x0f;
+        out[2 * i + 1] = (in[i] & 0xf0) >> 4;
+    }
+}
 
-static unsigned char sq[SQ_SIZE];
-static int sq_head, sq_tail;
-static int inform_phl_ready = 1;
+static void nibble_decode_c(unsigned char *out, const unsigned char *in, int len)
+{
+    int i;
 
-#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+    for (i = 0; i < len; i++)
+        out[i] = in[2 * i] | (((in[2 * i + 1] << 4) ^ in[2 * i + 1]) & 0xf0);
+}
 
-static int send_bytes_allowed = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 
-static int sq_len(void)
+/* SWAR: 4 frame bytes <-> 8 line bytes in a 64-bit register */
+static void nibble_encode_swar(unsigned char *out, const unsigned char *in, int len)
 {
-    return (sq_tail + SQ_SIZE - sq_head) % SQ_SIZE;
+    unsigned long long t;
+    unsigned int w;
+
+    for (; len >= 4; len -= 4, in += 4, out += 8) {
+        memcpy(&w, in, 4);
+        t = w;
+        t = (t | t << 16) & 0x0000ffff0000ffffULL;
+        t = (t | t << 8) & 0x00ff00ff00ff00ffULL;
+        t = (t & 0x000f000f000f000fULL) | (t << 4 & 0x0f000f000f000f00ULL);
+        memcpy(out, &t, 8);
+    }
+    nibble_encode_c(out, in, len);
 }
 
-int phl_sq_len(void)
+static void nibble_decode_swar(unsigned char *out, const unsigned char *in, int len)
 {
-    return sq_len();
+    unsigned long long t, a, b;
+    unsigned int w;
+
+    for (; len >= 4; len -= 4, in += 8, out += 4) {
+        memcpy(&t, in, 8);
+        a = t & 0x00ff00ff00ff00ffULL;
+        b = t >> 8 & 0x00ff00ff00ff00ffULL;
+        t = a | ((b << 4 ^ b) & 0x00f000f000f000f0ULL);
+        t = (t | t >> 8) & 0x0000ffff0000ffffULL;
+        w = (unsigned int)(t | t >> 16);
+        memcpy(out, &w, 4);
+    }
+    nibble_decode_c(out, in, len);
 }
 
-static void send_byte(unsigned char byte)
-{
-    inform_phl_ready = 1;
+#else
+#define nibble_encode_swar nibble_encode_c
+#define nibble_decode_swar nibble_decode_c
+#endif
 
-    if (send_bytes_allowed && sq_head == sq_tail) {
-        send(sock, (char *)&byte, 1, 0);
-        send_bytes_allowed--;
-        return;
-    }
+#if defined(__GNUC__) && defined(__x86_64__)
 
-    if (sq_len() == SQ_SIZE - 1)
-        ABORT("Physical Layer Sending Queue overflow");
+#include <immintrin.h>
 
-    sq[sq_tail] = byte;
-    sq_inc(sq_tail, 1);
+/* SSE2: 16 frame bytes <-> 32 line bytes */
+static void nibble_encode_sse2(unsigned char *out, const unsigned char *in, int len)
+{
+    const __m128i m = _mm_set1_epi8(0x0f);
+    __m128i x, lo, hi;
+
+    for (; len >= 16; len -= 16, in += 16, out += 32) {
+        x = _mm_loadu_si128((const __m128i *)in);
+        lo = _mm_and_si128(x, m);
+        hi = _mm_and_si128(_mm_srli_epi16(x, 4), m);
+        _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    nibble_encode_swar(out, in, len);
 }
 
-void send_frame(unsigned char *frame, int len)
+static void nibble_decode_sse2(unsigned char *out, const unsigned char *in, int len)
 {
-    int i;
-
-    send_byte(0xff);
-    
-    for (i = 0; i < len; i++) {
-        send_byte(frame[i] & 0x0f);
-        send_byte((frame[i] & 0xf0) >> 4);
+    const __m128i lo = _mm_set1_epi16(0x00ff), hi = _mm_set1_epi16(0x00f0);
+    __m128i x, y, b;
+
+    for (; len >= 16; len -= 16, in += 32, out += 16) {
+        x = _mm_loadu_si128((const __m128i *)in);
+        y = _mm_loadu_si128((const __m128i *)(in + 16));
+        b = _mm_srli_epi16(x, 8);
+        x = _mm_or_si128(_mm_and_si128(x, lo), _mm_and_si128(_mm_xor_si128(_mm_slli_epi16(b, 4), b), hi));
+        b = _mm_srli_epi16(y, 8);
+        y = _mm_or_si128(_mm_and_si128(y, lo), _mm_and_si128(_mm_xor_si128(_mm_slli_epi16(b, 4), b), hi));
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(x, y));
     }
-    send_byte(0xff);
+    nibble_decode_swar(out, in, len);
 }
 
-static int send_sq_data(unsigned int start, unsigned int end1)
+/* AVX2: 32 frame bytes <-> 64 line bytes */
+__attribute__((target("avx2")))
+static void nibble_encode_avx2(unsigned char *out, const unsigned char *in, int len)
 {
-    int ret;
-
-    if (start >= end1) 
-        return 0;
-
-    ret = send(sock, (char *)&sq[start], end1 - start, 0);
-    if (ret <= 0) {
-        lprintf("TCP Disconnected.\n");
-        exit(0);
+    const __m256i m = _mm256_set1_epi8(0x0f);
+    __m256i x, lo, hi, r0, r1;
+
+    for (; len >= 32; len -= 32, in += 32, out += 64) {
+        x = _mm256_loadu_si256((const __m256i *)in);
+        lo = _mm256_and_si256(x, m);
+        hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), m);
+        r0 = _mm256_unpacklo_epi8(lo, hi);
+        r1 = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(r0, r1, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(r0, r1, 0x31));
     }
-
-    return ret;
+    nibble_encode_sse2(out, in, len);
 }
 
-static void socket_send(void)
+__attribute__((target("avx2")))
+static void nibble_decode_avx2(unsigned char *out, const unsigned char *in, int len)
+{
+    const __m256i lo = _mm256_set1_epi16(0x00ff), hi = _mm256_set1_epi16(0x00f0);
+    __m256i x, y, b;
+
+    for (; len >= 32; len -= 32, in += 64, out += 32) {
+        x = _mm256_loadu_si256((const __m256i *)in);
+        y = _mm256_loadu_si256((const __m256i *)(in + 32));
+        b = _mm256_srli_epi16(x, 8);
+        x = _mm256_or_si256(_mm256_and_si256(x, lo), _mm256_and_si256(_mm256_xor_si256(_mm256_slli_epi16(b, 4), b), hi));
+        b = _mm256_srli_epi16(y, 8);
+        y = _mm256_or_si256(_mm256_and_si256(y, lo), _mm256_and_si256(_mm256_xor_si256(_mm256_slli_epi16(b, 4), b), hi));
+        x = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, y), 0xd8);
+        _mm256_storeu_si256((__m256i *)out, x);
+    }
+    nibble_decode_sse2(out, in, len);
+}
+
+#endif
+
+static void nibble_encode_dispatch(unsigned char *out, const unsigned char *in, int len);
+static void nibble_decode_dispatch(unsigned char *out, const unsigned char *in, int len);
+
+static void (*nibble_encode)(unsigned char *out, const unsigned char *in, int len) = nibble_encode_dispatch;
+static void (*nibble_decode)(unsigned char *out, const unsigned char *in, int len) = nibble_decode_dispatch;
+
+static void nibble_select(void)
+{
+    nibble_encode = nibble_encode_swar;
+    nibble_decode = nibble_decode_swar;
+#if defined(__GNUC__) && defined(__x86_64__)
+    nibble_encode = nibble_encode_sse2;
+    nibble_decode = nibble_decode_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        nibble_encode = nibble_encode_avx2;
+        nibble_decode = nibble_decode_avx2;
+    }
+#endif
+}
+
+static void nibble_encode_dispatch(unsigned char *out, const unsigned char *in, int len)
 {
-    static int last_ts = 0;
-    int n, send_tail = sq_head, send_bytes;
+    nibble_select();
+    nibble_encode(out, in, len);
+}
 
-    if (last_ts == 0) 
-        last_ts = now;
+static void nibble_decode_dispatch(unsigned char *out, const unsigned char *in, int len)
+{
+    nibble_select();
+    nibble_decode(out, in, len);
+}
 
-    if (now <= last_ts) 
+/* The peer has gone: quit, or have the data link thread quit once it has the frames still in */
+void link_closed(void)
+{
+#ifdef HAVE_PHY_THREAD
+    if (st == &phy0.station) {
+        if (phy0.closed == 0)
+            phy0.closed = 1;
         return;
+    }
+#endif
+    lprintf("TCP disconnected.\n");
+    exit(0);
+}
+
+/* send() on the link; on the shared memory rings and simulated, 0 means full */
+static int link_send(const unsigned char *buf, int n)
+{
+    if (mode_loop == LOOP_SIM)
+        return sim_send(buf, n);
+#ifdef HAVE_SHM
+    if (ch->shm_tx)
+        return shm_send(buf, n);
+#endif
+    st->loop_syscalls++;
+    return (int)send(ch->sock, (const char *)buf, n, 0);
+}
+
+/* Physical Layer: Sender */
+
+/* Sending queue structure */
+
+#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+
+int sq_len(void)
+{
+    return (ch->sq_tail + SQ_SIZE - ch->sq_head) % SQ_SIZE;
+}
+
+/* Bonded, the emptiest channel's: that is where the next frame goes */
+int phl_sq_len(void)
+{
+    struct CHANNEL *c = ch;
+    int i, n, len;
+
+#ifdef HAVE_PHY_THREAD
+    if (st->phy)
+        return phy_sq_len();
+#endif
+    len = sq_len();
+    for (i = 1; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if ((n = sq_len()) < len)
+            len = n;
+    }
+    ch = c;
+    return len;
+}
+
+/*
+    Line pacer: line bytes leave at the line rate, 2 line bytes per byte
+    time, as from a serializer clocked in microseconds. tx_time is when
+    the next byte is due on the line; it restarts when the queue fills
+    from empty, so an idle line saves nothing up, and a late wakeup
+    releases all the bytes that fell due meanwhile.
+
+    Every byte is late by the time between its due time and its release:
+    the mean, spread and maximum of that are the jitter of the emulated
+    line.
+*/
+#define TX_QUANTUM 32   /* line bytes worth a wakeup of their own */
+#define TX_MIN_US  1000 /* but not more often than this */
+#define TX_MEAS_CAP 32  /* measured time per byte: at most 1/32 over the line's */
+
+/* Line bytes due by time t */
+static int pacer_allow(long long t)
+{
+    double n = (t - ch->tx_time) / ch->tx_byte_us + 1;
+
+    return n < 1 ? 0 : n > SQ_SIZE ? SQ_SIZE : (int)n;
+}
+
+static void pacer_release(long long t, int n)
+{
+    double late = t - ch->tx_time, b = ch->tx_byte_us;
+
+    /*
+        goodput: what a backlogged line takes per byte, blocked sends and
+        all. Late wakeups only ever make a line look slower, and by chance
+        more on one line than on another: the cap keeps lines of the same
+        rate within 1/TX_MEAS_CAP of each other, so bond_pick() still
+        takes turns between them.
+    */
+    if (ch->tx_backlog) {
+        ch->tx_meas_us += ((t - ch->tx_last) / (double)n - ch->tx_meas_us) / 8;
+        if (ch->tx_meas_us < b)
+            ch->tx_meas_us = b;
+        else if (ch->tx_meas_us > b + b / TX_MEAS_CAP)
+            ch->tx_meas_us = b + b / TX_MEAS_CAP;
+    }
+
+    /* byte k = 0..n-1 was due at tx_time + k * b */
+    ch->tx_time += n * b;
+    ch->tx_last = t;
+    ch->tx_releases++;
+    ch->tx_bytes += n;
+    ch->tx_late_sum += n * late - b * n * (n - 1.0) / 2;
+    ch->tx_late_sq += n * late * late - late * b * n * (n - 1.0) + b * b * n * (n - 1.0) * (2.0 * n - 1) / 6;
+    if (late > ch->tx_late_max)
+        ch->tx_late_max = late;
+}
+
+/* Time (us) until the bytes queued now have left the line */
+long long pacer_drain_us(void)
+{
+    double d;
+
+#ifdef HAVE_PHY_THREAD
+    if (st->phy)
+        return phy_drain_us();
+#endif
+    d = (ch->tx_time > st->now_us ? ch->tx_time : st->now_us) + sq_len() * ch->tx_byte_us - st->now_us;
+    return (long long)d;
+}
+
+/* " #n" naming the channel in the reports of a bonded station, "" otherwise */
+static const char *chan_tag(void)
+{
+    static char tag[16];
+
+    if (st->nchan == 1)
+        return "";
+    sprintf(tag, " #%d", ch->nr);
+    return tag;
+}
+
+static void pacer_report(void)
+{
+    double avg, var;
+    int i;
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        avg = ch->tx_bytes ? ch->tx_late_sum / ch->tx_bytes : 0.0;
+        var = ch->tx_bytes ? ch->tx_late_sq / ch->tx_bytes - avg * avg : 0.0;
+        lprintf("Line pacer%s: %u releases, %.1f bytes each, departure late avg %.0f us, jitter %.0f us, max %.0f us\n",
+            chan_tag(), ch->tx_releases, ch->tx_releases ? ch->tx_bytes / ch->tx_releases : 0.0, avg,
+            var > 0 ? sqrt(var) : 0.0, ch->tx_late_max);
+    }
+    ch = st->chan[0];
+}
+
+void pacer_init(void)
+{
+    ch->tx_byte_us = 4000000.0 / ch->bps;
+    ch->tx_meas_us = ch->tx_byte_us;
+}
+
+/* Queue line bytes; with the queue empty, what is due right now goes out at once */
+static void send_bytes(const unsigned char *buf, int n)
+{
+    long long t;
+    int ret, first, k;
+
+    st->inform_phl_ready = 1;
+
+    if (ch->sq_head == ch->sq_tail) {
+        t = get_us();
+        if (ch->tx_time < t) /* the line has gone idle */
+            ch->tx_time = (double)t;
+    }
+
+    if (ch->sq_head == ch->sq_tail && !ch->tx_blocked && mode_loop != LOOP_URING && (k = pacer_allow(t)) > 0) {
+        ret = link_send(buf, n < k ? n : k);
+        if (ret > 0) {
+            pacer_release(t, ret);
+            buf += ret;
+            n -= ret;
+        }
+    }
+
+    if (sq_len() + ch->sq_flight + n > SQ_SIZE - 1)
+        ABORT("Physical Layer Sending Queue overflow");
+
+    first = n < SQ_SIZE - ch->sq_tail ? n : SQ_SIZE - ch->sq_tail;
+    memcpy(&ch->sq[ch->sq_tail], buf, first);
+    memcpy(ch->sq, buf + first, n - first);
+    sq_inc(ch->sq_tail, n);
+    if (n)
+        ch->tx_backlog = 1;
+}
+
+#define LINE_CHUNK 1024 /* frame bytes encoded per pass */
+
+void send_frame(unsigned char *frame, int len)
+{
+    unsigned char line[2 * (LINE_CHUNK + BOND_HDR) + 2], hdr[BOND_HDR];
+    int n, pos = 0;
 
-    send_bytes_allowed = (now - last_ts) * CHAN_BPS / 8 / 1000 * 2;
-    n = sq_len();
-    if (n > send_bytes_allowed)
-        n = send_bytes_allowed;
+#ifdef HAVE_PHY_THREAD
+    if (st->phy) { /* the PHY thread frames it */
+        phy_send(frame, len);
+        return;
+    }
+#endif
+    st->loop_frames++;
+    st->tx_frames++;
+    line[pos++] = 0xff;
+    if (st->nchan > 1) {
+        ch = bond_pick(2 * (BOND_HDR + len) + 2);
+        hdr[0] = (unsigned char)st->bond_tx_seq;
+        hdr[1] = (unsigned char)(st->bond_tx_seq >> 8);
+        hdr[2] = (unsigned char)crc8(hdr, 2);
+        st->bond_tx_seq++;
+        nibble_encode(line + pos, hdr, BOND_HDR);
+        pos += 2 * BOND_HDR;
+    }
+    ch->tx_frames++;
+    do {
+        n = len < LINE_CHUNK ? len : LINE_CHUNK;
+        nibble_encode(line + pos, frame, n);
+        pos += 2 * n;
+        frame += n;
+        len -= n;
+        if (len == 0)
+            line[pos++] = 0xff;
+        send_bytes(line, pos);
+        pos = 0;
+    } while (len > 0);
+    ch = st->chan[0];
+}
+
+static int send_sq_data(unsigned int start, unsigned int end1)
+{
+    int ret;
+
+    if (start >= end1 || ch->tx_blocked) 
+        return 0;
+
+#ifdef HAVE_IO_URING
+    if (mode_loop == LOOP_URING)
+        return uring_send(&ch->sq[start], end1 - start);
+#endif
+    ret = link_send(&ch->sq[start], end1 - start);
+#ifdef HAVE_SHM
+    if (ch->shm_tx) /* 0: the ring is full, try again later */
+        return ret;
+#endif
+    if (mode_loop == LOOP_SIM) /* 0: the peer's delay line is full, until the peer has made room */
+        return ret;
+#ifdef HAVE_EPOLL
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ch->tx_blocked = 1;
+        return 0;
+    }
+#endif
+    if (ret <= 0) {
+        link_closed();
+        return 0;
+    }
+
+    return ret;
+}
+
+static void socket_send(void)
+{
+    int n, send_tail = ch->sq_head, send_bytes;
+
+    n = pacer_allow(st->now_us);
+    if (n > sq_len())
+        n = sq_len();
+    if (n == 0) 
+        return;
+    /* the epoll and io_uring loops hold bytes back for the pacer's own wakeup, a quantum at a time */
+    if (!mode_pace && (mode_loop == LOOP_EPOLL || mode_loop == LOOP_URING) && n < TX_QUANTUM && n < sq_len())
+        return;
     sq_inc(send_tail, n);
 
-    if (send_tail >= sq_head) 
-        send_bytes = send_sq_data(sq_head, send_tail);
+    if (send_tail >= ch->sq_head) 
+        send_bytes = send_sq_data(ch->sq_head, send_tail);
     else {
-        send_bytes = send_sq_data(sq_head, SQ_SIZE);
+        send_bytes = send_sq_data(ch->sq_head, SQ_SIZE);
         send_bytes += send_sq_data(0, send_tail);
     }
 
-    sq_inc(sq_head, send_bytes);
-    send_bytes_allowed -= send_bytes;
-
-    last_ts = now;
+    sq_inc(ch->sq_head, send_bytes);
+    if (send_bytes) {
+        pacer_release(st->now_us, send_bytes);
+        ch->tx_backlog = sq_len() > 0;
+    }
 }
 
 /* Physical Layer: Receiver */
 
-#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK))
+/*
+    Delay line: received line bytes wait in a preallocated ring until
+    their commit time. Every recv() appends one span tagged with its
+    commit time (extending the last span when that time is the same),
+    and wait_for_event() decodes everything committed in one go.
+*/
 
-struct BLK {
-    int commit_ts;
-    int rptr, wptr;
-    struct BLK *link;
-    unsigned char data[BLKSIZE];
-};
+#define DL_MAX   (64 * 1024 * 1024) /* ring size limit */
 
-static struct BLK *rblk_head, *rblk_tail;
-static unsigned int nbits;
+/* noise is imposed per BLKSIZE bytes received: a tick of line data at 16 times the line rate */
+#define BLKSIZE (ch->bps > 16 * 1024 * 1024 ? 65536 : \
+    16 * (ch->bps > CHAN_BPS ? ch->bps : CHAN_BPS) / 8 / (1000 / DEFAULT_TICK))
 
-static void socket_recv(void)
+static void delay_line_report(void)
 {
-    struct BLK *blk;
-    unsigned char *p;
+    int i;
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        lprintf("Delay line%s: %u KB ring, high-water %u bytes in %u spans, %u recv() calls of %.0f bytes\n",
+            chan_tag(), ch->dl_size / 1024, ch->dl_hwm, ch->dl_span_hwm, ch->dl_recvs,
+            ch->dl_recvs ? ch->dl_bytes / ch->dl_recvs : 0.0);
+    }
+    ch = st->chan[0];
+}
+
+/* room for twice the line data of the propagation delay and a tick or two */
+void delay_line_init(void)
+{
+    double need = (double)ch->bps / 4 * (CHAN_DELAY + 4 * DEFAULT_TICK) / 1000 * 2;
 
-    blk = (struct BLK *)malloc(sizeof(struct BLK));
-    if (blk == NULL) 
+    for (ch->dl_size = 64 * 1024; ch->dl_size < need && ch->dl_size < DL_MAX; ch->dl_size *= 2)
+        ;
+    ch->dl_mask = ch->dl_size - 1;
+    ch->dl = (unsigned char *)malloc(ch->dl_size);
+    if (ch->dl == NULL) 
         ABORT("No enough memory");
+}
 
-    blk->rptr = 0;
-    blk->wptr = recv(sock, (char *)blk->data, BLKSIZE, 0);
-    if (blk->wptr <= 0) {
-        lprintf("TCP disconnected.\n");
-        exit(0);
+/* Impose noise on 'len' ring bytes from 'start' */
+static void impose_noise(unsigned int start, int len)
+{
+    unsigned char *p;
+    int a;
+    double rate, fact;
+
+    rate = (double)st->noise / st->nbits;
+    fact = rate > ber ? 3.5 : 6.0;
+    a = (int)((1.0 - pow(1.0 - ber, fact * len)) * (PHL_RAND_MAX + 1.0) + 0.5);
+    if (phl_rand() <= a) {
+        p = &ch->dl[(start + phl_rand() % len) & ch->dl_mask];
+        if (*p & 0x0f) {
+            *p ^= 1 << (phl_rand() % 8);
+            st->noise++;
+            dbg_warning("Impose noise on received data, %u/%u=%.1E\n", st->noise, st->nbits, (double)st->noise / st->nbits);
+        }
     }
-    nbits += blk->wptr * 4;
+}
+
+/* Append the 'n' line bytes just stored at dl_tail to the delay line */
+void dl_append(int n)
+{
+    unsigned int off;
+    long long commit_us;
+    int k;
 
-    /* Impose noise */
+    st->nbits += n * 4;
+    ch->dl_recvs++;
+    ch->dl_bytes += n;
+
+    /* Impose noise, as on BLKSIZE-byte receives */
     if (ber != 0.0) {
-        int a;
-        double rate, fact;
-
-        rate = (double)noise / nbits;
-        fact = rate > ber ? 3.5 : 6.0;
-        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr)) * (RAND_MAX + 1.0) + 0.5);
-        if (rand() <= a) {
-            p = &blk->data[rand() % blk->wptr];
-            if (*p & 0x0f) {
-                *p ^= 1 << (rand() % 8);
-                noise++;
-                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
-            }
+        for (off = 0; off < (unsigned int)n; off += BLKSIZE) {
+            k = n - (int)off < BLKSIZE ? n - (int)off : BLKSIZE;
+            impose_noise(ch->dl_tail + off, k);
         }
     }
 
-    blk->commit_ts = now + CHAN_DELAY - 10;
-    blk->link = NULL; 
+    if (mode_loop == LOOP_TICK) /* read up to a tick late */
+        commit_us = st->now_us + (CHAN_DELAY - 10) * 1000;
+    else /* read as it comes in: the propagation delay, exactly */
+        commit_us = st->now_us + CHAN_DELAY * 1000;
 
-    if (rblk_head == NULL) 
-        rblk_head = rblk_tail = blk;
+    ch->dl_tail += n;
+    if (dl_pending() && ch->dl_span[(ch->span_tail - 1) % DL_SPANS].commit_us == commit_us)
+        ch->dl_span[(ch->span_tail - 1) % DL_SPANS].end = ch->dl_tail;
     else {
-        rblk_tail->link = blk;
-        rblk_tail = blk;
+        ch->dl_span[ch->span_tail % DL_SPANS].commit_us = commit_us;
+        ch->dl_span[ch->span_tail % DL_SPANS].end = ch->dl_tail;
+        ch->span_tail++;
     }
+
+    if (ch->dl_tail - ch->dl_head > ch->dl_hwm)
+        ch->dl_hwm = ch->dl_tail - ch->dl_head;
+    if (ch->span_tail - ch->span_head > ch->dl_span_hwm)
+        ch->dl_span_hwm = ch->span_tail - ch->span_head;
 }
 
-static unsigned char recv_byte(void)
+static void socket_recv(void)
 {
-    unsigned char ch;
-    struct BLK *blk = rblk_head;
+    unsigned int room = dl_room(), pos = ch->dl_tail & ch->dl_mask, first;
+    int n;
 
-    if (blk == NULL || blk->commit_ts > now) 
-        ABORT("recv_byte(): Receiving Queue is empty");
+    if (room == 0) /* full: leave it in the socket, TCP holds the peer back */
+        return;
+    first = room < ch->dl_size - pos ? room : ch->dl_size - pos;
 
-    ch = blk->data[blk->rptr++];
-    if (blk->rptr == blk->wptr) {
-        rblk_head = blk->link;
-        free(blk);
-    } 
-    
-    return ch;
+#ifdef HAVE_SHM
+    if (ch->shm_rx) {
+        if ((n = shm_recv(ch->dl + pos, first, ch->dl, room - first)) > 0)
+            dl_append(n);
+        return;
+    }
+#endif
+
+#ifdef _WIN32
+    n = recv(ch->sock, (char *)ch->dl + pos, first, 0);
+#else
+    {
+        struct iovec iov[2];
+
+        iov[0].iov_base = ch->dl + pos;
+        iov[0].iov_len = first;
+        iov[1].iov_base = ch->dl;
+        iov[1].iov_len = room - first;
+        n = (int)readv(ch->sock, iov, room > first ? 2 : 1);
+    }
+#endif
+    st->loop_syscalls++;
+#ifdef HAVE_EPOLL
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+#endif
+    if (n <= 0) {
+        link_closed();
+        return;
+    }
+    dl_append(n);
 }
 
 /* Timer Management */
 
-#define NTIMER 129
-static int timer[NTIMER];
-#define ACK_TIMER_ID (NTIMER - 1)
+/* wheel timer 0 is the ACK timer, DATA timer nr is wheel timer nr + 1 */
+#define ACK_TIMER_ID 0
+#define TIMER_SHIFT  10 /* wheel slots of 1.024 ms */
+
+static void timer_start(unsigned int id, long long deadline)
+{
+    if (st->timers == NULL && (st->timers = tw_create(TIMER_SHIFT)) == NULL)
+        ABORT("No enough memory");
+    if (!tw_start(st->timers, id, deadline))
+        ABORT("No enough memory for timers");
+}
+
+void start_timer_us(unsigned int nr, unsigned int us)
+{
+    if (nr + 1 == 0) 
+        ABORT("start_timer(): timer No. out of range");
+    timer_start(nr + 1, st->now_us + pacer_drain_us() + us);
+}
 
 void start_timer(unsigned int nr, unsigned int ms)
 {
-    if (nr >= ACK_TIMER_ID) 
-        ABORT("start_timer(): timer No. must be 0~128");
-    timer[nr] = now + phl_sq_len() * 8000 / CHAN_BPS + ms;
+    start_timer_us(nr, ms * 1000);
 }
 
 void stop_timer(unsigned int nr)
 {
-    if (nr < ACK_TIMER_ID) 
-        timer[nr] = 0;
+    if (st->timers && nr + 1 != 0) 
+        tw_stop(st->timers, nr + 1);
 }
 
 int get_timer(unsigned int nr)
 {
-    if (nr >= ACK_TIMER_ID || timer[nr] == 0)
+    long long deadline = st->timers && nr + 1 != 0 ? tw_deadline(st->timers, nr + 1) : 0;
+
+    if (deadline == 0)
         return 0;
-    return timer[nr] > now ? timer[nr] - now : 0;
+    return deadline > st->now_us ? (int)((deadline - st->now_us) / 1000) : 0;
+}
+
+void start_ack_timer_us(unsigned int us)
+{
+    if (st->timers == NULL || tw_deadline(st->timers, ACK_TIMER_ID) == 0)
+        timer_start(ACK_TIMER_ID, st->now_us + us);
 }
 
 void start_ack_timer(unsigned int ms)
 {
-    if (timer[ACK_TIMER_ID] == 0)
-        timer[ACK_TIMER_ID] = now + ms;
+    start_ack_timer_us(ms * 1000);
 }
 
 void stop_ack_timer(void)
 {
-    timer[ACK_TIMER_ID] = 0;
+    if (st->timers)
+        tw_stop(st->timers, ACK_TIMER_ID);
 }
 
+/* earliest expired timer first */
 static int scan_timer(int *nr)
 {
-    int i;
+    unsigned int id;
+    long long deadline;
 
-    for (i = 0; i < NTIMER; i++) {
-        if (timer[i] && timer[i] <= now) {
-            *nr = i;
-            timer[i] = 0;
-            return i == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
-        }
-    }
-    return 0;
+    if (st->timers == NULL || (deadline = tw_expire(st->timers, st->now_us, &id)) == 0)
+        return 0;
+
+    st->timer_fires++;
+    st->timer_late_sum += (double)(st->now_us - deadline);
+    if (st->now_us - deadline > st->timer_late_max)
+        st->timer_late_max = st->now_us - deadline;
+
+    if (id == ACK_TIMER_ID)
+        return ACK_TIMEOUT;
+    *nr = (int)(id - 1);
+    return DATA_TIMEOUT;
 }
 
 /* Network Layer Functions */
 
-static int network_layer_active = 0;
-static int rpackets, rbytes;
-
 void enable_network_layer(void)
 {
-    network_layer_active = 1;
+    st->network_layer_active = 1;
 }
 
 void disable_network_layer(void)
 {
-    network_layer_active = 0;
+    st->network_layer_active = 0;
 }
 
 static int network_layer_ready(void)
 {
-    static int last_ts = 0;
-
-    if (!network_layer_active)
+    if (!st->network_layer_active)
         return 0;
 
     if (mode_flood) 
         return 1;
 
-    if ((now - last_ts) * CHAN_BPS / 8 / 1000 < PKT_LEN * 3 / 4)
+    if ((st->now_us - st->network_layer_us) * st->chan_bps / 8 / 1000000 < PKT_LEN * 3 / 4)
         return 0;
 
-    if (station == 'b') {
-        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
-            if (now - last_ts < 4000 + rand() % 500)
+    if (st->station == 'b') {
+        if (st->now / 1000 / mode_cycle % 2 != mode_ibib) {
+            if (st->now_us - st->network_layer_us < (4000 + phl_rand() % 500) * 1000LL)
                 return 0;
         }
-        if (now < CHAN_DELAY + 3 * PKT_LEN * 8000 / CHAN_BPS)
+        if (st->now < CHAN_DELAY + 3 * PKT_LEN * 8000 / st->chan_bps)
             return 0;
     }
 
-    last_ts = now;
+    st->network_layer_us = st->now_us;
 
     return 1;
 }
 
 static int randA(void)
 {
-    static unsigned int holdrand = 0x65109bc4;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    return ((st->rand_a = st->rand_a * 214013L + 2531011L) >> 16) & 0x7fff;
 }
 
 static int randB(void)
 {
-    static unsigned int holdrand = 0x1e459090;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    return ((st->rand_b = st->rand_b * 214013L + 2531011L) >> 16) & 0x7fff;
 }
 
 #define next_char() ((unsigned char)(my_rand() & 0xff))
 
-static int layer3_ready = 0;
-
 int get_packet(unsigned char *packet)
 {
-    static int pkt_no = 0;
     int i, len;
-    int (*my_rand)(void) = station == 'a' ? randA : randB;
+    int (*my_rand)(void) = st->station == 'a' ? randA : randB;
 
-    if (!layer3_ready)
+    if (!st->layer3_ready)
         ABORT("get_packet(): Network layer is not ready for a new packet");
     
     len = PKT_LEN;
     for (i = 2; i < len; i++)
         packet[i] = next_char();
-    *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
+    *(unsigned short *)packet = (st->station - 'a' + 1) * 10000 + (st->pkt_no++ % 10000);
 
-    layer3_ready = 0;
+    st->layer3_ready = 0;
 
     return len;
 }
 
-static int ts0;
-
 void put_packet(unsigned char *packet, int len)
 {
-    static int last_ts = 0;
-    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+    int i, (*my_rand)(void) = st->station == 'a' ? randB : randA;
 
     if (len != PKT_LEN) 
         ABORT("Bad Packet length");
@@ -666,15 +1723,26 @@ void put_packet(unsigned char *packet, int len)
         if (packet[i] != next_char()) 
             ABORT("Network Layer received a bad packet from data link layer");
     }
-    rpackets++;
-    rbytes += len;
+    st->rpackets++;
+    st->rbytes += len;
 
-    if (now - last_ts > 2000 && now > ts0 + 2000) {
+    if (st->now - st->last_ts > 2000 && st->now > st->ts0 + 2000) {
         double bps;
-        bps = (double)rbytes * 8 * 1000 / (now - ts0);
+        int noise = st->noise;
+        unsigned int nbits = st->nbits;
+
+#ifdef HAVE_PHY_THREAD
+        if (st->phy) { /* the noise is the PHY thread's */
+            noise = __atomic_load_n(&st->phy->station.noise, __ATOMIC_RELAXED);
+            nbits = __atomic_load_n(&st->phy->station.nbits, __ATOMIC_RELAXED);
+        }
+#endif
+        bps = (double)st->rbytes * 8 * 1000 / (st->now - st->ts0);
+        if (mode_loop == LOOP_SIM) /* both stations share the log */
+            lprintf("%s ", station_name());
         lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
-            rpackets, bps, bps / CHAN_BPS * 100, noise, (double)noise/nbits);
-        last_ts = now;
+            st->rpackets, bps, bps / st->chan_bps * 100, noise, (double)noise / nbits);
+        st->last_ts = st->now;
     }
 }
 
@@ -715,181 +1783,535 @@ void dbg_warning(char *fmt, ...)
 	}
 }
 
+/* Event Loop Backends */
+
+/* us socket data may wait for a wakeup already due: a line byte time of the fastest channel */
+long long rx_slack(struct STATION *s)
+{
+    double b = s->chan[0]->tx_byte_us;
+    int i;
+
+    for (i = 1; i < s->nchan; i++) {
+        if (s->chan[i]->tx_byte_us < b)
+            b = s->chan[i]->tx_byte_us;
+    }
+    return (long long)b;
+}
+
+static const char *loop_names[] = { "tick", "epoll", "uring", "sim" };
+
+static void loop_report(void)
+{
+    double secs = st->now > 0 ? st->now / 1000.0 : 1.0;
+
+    lprintf("Event loop %s: %u wakeups (%.1f/s), %u timer expiries, late avg %.0f us, max %lld us\n",
+        loop_names[mode_loop], st->loop_wakeups, st->loop_wakeups / secs,
+        st->timer_fires, st->timer_fires ? st->timer_late_sum / st->timer_fires : 0.0, st->timer_late_max);
+#ifdef _WIN32
+    lprintf("Event loop %s: %u system calls (%.1f/s, %.2f per frame)\n", loop_names[mode_loop],
+        st->loop_syscalls, st->loop_syscalls / secs, st->loop_frames ? (double)st->loop_syscalls / st->loop_frames : 0.0);
+#else
+    {
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        lprintf("Event loop %s: %u system calls (%.1f/s, %.2f per frame), %ld+%ld context switches (%.1f/s)\n",
+            loop_names[mode_loop], st->loop_syscalls, st->loop_syscalls / secs,
+            st->loop_frames ? (double)st->loop_syscalls / st->loop_frames : 0.0,
+            ru.ru_nvcsw, ru.ru_nivcsw, (ru.ru_nvcsw + ru.ru_nivcsw) / secs);
+    }
+#endif
+}
+
+/* 
+    Earliest of timers, next block commit, network layer pacing and the
+    line pacer. The epoll and io_uring loops give the pacer a wakeup of
+    its own when a quantum (or all that is queued, if less) is due, so
+    the line leaves in even TX_QUANTUM releases. The tick and --sim loops
+    let the transmit allowance ride along with the other wakeups, unless
+    none of them is due within two quanta. With --pace, the pacer gets a
+    wakeup every 'mode_pace' us instead.
+*/
+long long next_deadline(void)
+{
+    long long t, d;
+    int i, k;
+
+    t = (mode_life + 1) * 1000LL;
+
+    if (st->timers && (d = tw_next(st->timers)) != 0 && d < t)
+        t = d;
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if (dl_pending() && dl_commit_us() < t)
+            t = dl_commit_us();
+    }
+
+    if (st->bond_gap_us && st->bond_gap_us + st->bond_wait_us < t)
+        t = st->bond_gap_us + st->bond_wait_us;
+
+    if (st->network_layer_active && !mode_flood) {
+        d = st->network_layer_us + PKT_LEN * 3 / 4 * 8000000LL / st->chan_bps;
+        if (d <= st->now_us) /* station B's random pacing, look again a tick later */
+            d = st->now_us + DEFAULT_TICK * 1000;
+        if (d < t)
+            t = d;
+    }
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if (sq_len() == 0 || ch->tx_blocked)
+            continue;
+        if (mode_pace) {
+            /* paced: the next byte is released on its own timerfd wakeup */
+            d = (long long)ceil(ch->tx_time);
+            if (d < ch->tx_last + mode_pace)
+                d = ch->tx_last + mode_pace;
+            if (d < t)
+                t = d;
+        } else if (mode_loop == LOOP_EPOLL || mode_loop == LOOP_URING) {
+            k = sq_len() < TX_QUANTUM ? sq_len() : TX_QUANTUM;
+            d = (long long)ceil(ch->tx_time + (k - 1) * ch->tx_byte_us);
+            if (d < ch->tx_last + TX_MIN_US)
+                d = ch->tx_last + TX_MIN_US;
+            if (d < t)
+                t = d;
+        } else {
+            k = sq_len() < TX_QUANTUM ? sq_len() : TX_QUANTUM;
+            d = (long long)(k * ch->tx_byte_us);
+            if (d < TX_MIN_US)
+                d = TX_MIN_US;
+            if (t > ch->tx_time + 2 * d)
+                t = (long long)ceil(ch->tx_time + d);
+        }
+    }
+    ch = st->chan[0];
+
+    return t;
+}
+
+void loop_init(void)
+{
+#ifdef HAVE_EPOLL
+    if (mode_loop == LOOP_EPOLL)
+        epoll_init();
+#endif
+#ifdef HAVE_IO_URING
+    if (mode_loop == LOOP_URING) {
+        if (mode_shm)
+            ABORT("The io_uring loop needs the socket, not shared memory rings");
+        uring_init();
+        if (mode_pace)
+            prctl(PR_SET_TIMERSLACK, 1000UL);
+    }
+#endif
+}
+
 /* Event Generator */
 
-#define PHL_SQ_LEVEL  50 
+/* Received frames come from slabs of RF_SLAB and go back to a free list, never to free() */
+#define RF_SLAB 16
+
+static struct RCV_FRAME *rf_alloc(void)
+{
+    struct RCV_FRAME *f;
+    int i;
 
-static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
-static int bias_cnt;
+    if (st->rf_free == NULL) {
+        f = (struct RCV_FRAME *)malloc(RF_SLAB * sizeof(struct RCV_FRAME));
+        if (f == NULL) 
+            ABORT("No enough memory");
+        for (i = 0; i < RF_SLAB; i++) {
+            f[i].link = st->rf_free;
+            st->rf_free = &f[i];
+        }
+    }
 
-struct RCV_FRAME {
-    int len;
-    int state;
-    unsigned char frame[2048];
-    struct RCV_FRAME *link;
-};
+    f = st->rf_free;
+    st->rf_free = f->link;
+
+    f->len = 0;
+    f->state = 0;
+    f->header_sent = 0;
+    f->off = st->nchan > 1 ? BOND_HDR : 0;
+    f->fcs = fcs_init();
+    f->link = NULL;
+    return f;
+}
+
+void rf_queue(struct RCV_FRAME **head, struct RCV_FRAME **tail, struct RCV_FRAME *f)
+{
+    if (*head == NULL) 
+        *head = *tail = f;
+    else {
+        (*tail)->link = f;
+        *tail = f;
+    }
+}
+
+int phl_cut_through(int hdr_len)
+{
+    if (!mode_cut_through || hdr_len <= 0 || hdr_len > (int)sizeof(st->rf_hdr))
+        return 0;
+    st->rf_hdr_len = hdr_len;
+    return 1;
+}
+
+int recv_frame_header(unsigned char *buf, int size)
+{
+    if (!st->rf_hdr_ready)
+        ABORT("recv_frame_header(): No frame header received");
+    if (size < st->rf_hdr_len)
+        ABORT("recv_frame_header(): Buffer is too small");
+
+    memcpy(buf, st->rf_hdr, st->rf_hdr_len);
+    st->rf_hdr_ready = 0;
 
-static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+    return st->rf_hdr_len;
+}
+
+/* 
+    A frame still on the line has its header and at least one more byte in:
+    snapshot the header for FRAME_HEADER. Frames no longer than a header
+    (ACK/NAK) are only ever reported whole.
+*/
+static int frame_header_check(void)
+{
+    struct RCV_FRAME *f = ch->rf_buf;
+
+    if (st->rf_hdr_len == 0 || f == NULL || f->header_sent || f->len <= f->off + st->rf_hdr_len)
+        return 0;
+
+    memcpy(st->rf_hdr, f->frame + f->off, st->rf_hdr_len);
+    st->rf_hdr_frame = f;
+    f->header_sent = 1;
+    st->rf_hdr_ready = 1;
+
+    return 1;
+}
 
 int recv_frame(unsigned char *buf, int size)
 {
-    int len;
-    struct RCV_FRAME *next;
+    return recv_frame_fcs(buf, size, NULL);
+}
+
+int recv_frame_fcs(unsigned char *buf, int size, int *good)
+{
+    unsigned char *frame;
+    int len, ok;
     char msg[256];
 
-    if (rf_head == NULL) 
+    if (st->rf_head == NULL) 
         ABORT("recv_frame(): Receiving Queue is empty");
 
-    len = rf_head->len;
+    ok = recv_frame_peek(&frame, &len);
 
     if (size < len) { 
         sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
         ABORT(msg);
     }
     
-    memcpy(buf, rf_head->frame, len);
+    memcpy(buf, frame, len);
+    if (good)
+        *good = ok;
 
-    next = rf_head->link;
-    if (next == NULL) 
-        rf_tail = NULL;
-    free(rf_head); 
-    rf_head = next;
+    recv_frame_release();
 
     return len;
 }
 
-int wait_for_event(int *arg)
+int recv_frame_peek(unsigned char **frame, int *len)
 {
-    fd_set rfd, wfd;
-    struct timeval tm;
-    int event, n, i, nfds;
-    unsigned char ch;
+    if (st->rf_head == NULL) 
+        ABORT("recv_frame_peek(): Receiving Queue is empty");
 
-    for (;;) {
+    *frame = st->rf_head->frame + st->rf_head->off;
+    *len = st->rf_head->len - st->rf_head->off;
 
-        now = get_ms();
-     
-        /* commit received socket data */
-        if (rblk_head && rblk_head->commit_ts <= now) {
-            n = rblk_head->wptr - rblk_head->rptr;
-            
-            if (ts0 == 0) {
-                ts0 = now;
-                if (ts0 >= n / 2)
-                    ts0 -= n / 2;
-            }
-
-            for (i = 0; i < n; i++) {
-                ch = recv_byte();
-                if (ch == 0xff) {
-                    if (rf_buf == NULL) 
-                        rf_buf = (struct RCV_FRAME *)calloc(1, sizeof(struct RCV_FRAME));
-                    else {
-                        if (rf_buf->len > 0) {
-                            if (rf_head == NULL) 
-                                rf_head = rf_tail = rf_buf;
-                            else {
-                                rf_tail->link = rf_buf;
-                                rf_tail = rf_buf;
-                            }
-                            rf_buf = NULL;
-                        }
-                    }
-                } else if (rf_buf && rf_buf->len < sizeof(rf_buf->frame)) {
-                    if (rf_buf->state == 0) {
-                        rf_buf->frame[rf_buf->len] = ch;
-                        rf_buf->state = 1;
-                    } else {
-                        rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
-                        rf_buf->len++;
-                        rf_buf->state = 0;
-                    }
-                }
-            }
-
-            if (rf_head)
-                return FRAME_RECEIVED;
+    return fcs_good(st->rf_head->fcs);
+}
+
+void recv_frame_release(void)
+{
+    struct RCV_FRAME *next;
+
+    if (st->rf_head == NULL) 
+        ABORT("recv_frame_release(): Receiving Queue is empty");
+
+    next = st->rf_head->link;
+    if (next == NULL) 
+        st->rf_tail = NULL;
+#ifdef HAVE_PHY_THREAD
+    if (st->phy)
+        phy_release(st->rf_head);
+    else
+#endif
+    {
+        st->rf_head->link = st->rf_free;
+        st->rf_free = st->rf_head;
+    }
+    st->rf_head = next;
+}
+
+/* Append line nibbles (no delimiters) to the frame being assembled */
+static void frame_pack(const unsigned char *p, int n)
+{
+    struct RCV_FRAME *f = ch->rf_buf;
+    int room = (int)sizeof(f->frame) - f->len, pairs, len0 = f->len;
+
+    if (n == 0 || room == 0)
+        return;
+
+    if (f->state == 1) {
+        f->frame[f->len++] |= ((*p << 4) ^ *p) & 0xf0;
+        f->state = 0;
+        p++;
+        n--;
+        room--;
+    }
+
+    pairs = n / 2 < room ? n / 2 : room;
+    nibble_decode(f->frame + f->len, p, pairs);
+    f->len += pairs;
+
+    if (n > 2 * pairs && f->len < (int)sizeof(f->frame)) {
+        f->frame[f->len] = p[2 * pairs];
+        f->state = 1;
+    }
+
+    /* the bytes just packed are still in L1, check them now */
+    if (len0 < f->off)
+        len0 = f->off;
+    if (f->len > len0)
+        f->fcs = fcs_update(f->fcs, f->frame + len0, f->len - len0);
+}
+
+/* Reassemble frames from committed line bytes, 0xff delimited */
+static void frame_decode(const unsigned char *p, int n)
+{
+    const unsigned char *end = p + n, *d;
+
+    while (p < end) {
+        /* memchr() is a vectorized scan in glibc */
+        d = (const unsigned char *)memchr(p, 0xff, end - p);
+        if (d == NULL)
+            d = end;
+        if (ch->rf_buf)
+            frame_pack(p, (int)(d - p));
+        if (d == end)
+            break;
+
+        if (ch->rf_buf == NULL) 
+            ch->rf_buf = rf_alloc();
+        else if (ch->rf_buf->len > 0) {
+            if (st->nchan > 1)
+                bond_arrive(ch->rf_buf);
+            else
+                rf_queue(&st->rf_head, &st->rf_tail, ch->rf_buf);
+            ch->rf_buf = NULL;
+            st->loop_frames++;
         }
+        p = d + 1;
+    }
+}
+
+/* Commit received socket data, every span that is due at once, on every channel */
+void chan_commit(void)
+{
+    unsigned int end, pos, n, first;
+    int i;
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if (!dl_pending() || dl_commit_us() > st->now_us)
+            continue;
+
+        end = ch->dl_head;
+        while (dl_pending() && dl_commit_us() <= st->now_us)
+            end = ch->dl_span[ch->span_head++ % DL_SPANS].end;
+        n = end - ch->dl_head;
         
-        /* test socket send/receive */
-        tm.tv_sec = tm.tv_usec = 0;
-        FD_ZERO(&rfd);
-        FD_ZERO(&wfd);
-        FD_SET(sock, &rfd);
-        FD_SET(sock, &wfd);
-
-        nfds = (int)(sock + 1);
-        if (select(nfds, &rfd, &wfd, 0, &tm) < 0) 
-            ABORT("system select()");
-         
+        if (st->ts0 == 0) {
+            st->ts0 = st->now;
+            if (st->ts0 >= (int)n / 2)
+                st->ts0 -= n / 2;
+        }
+
+        pos = ch->dl_head & ch->dl_mask;
+        first = n < ch->dl_size - pos ? n : ch->dl_size - pos;
+        frame_decode(ch->dl + pos, (int)first);
+        if (n > first)
+            frame_decode(ch->dl, (int)(n - first));
+        ch->dl_head = end;
+
+        if (!st->rf_hdr_ready)
+            frame_header_check();
+    }
+    ch = st->chan[0];
+
+    if (st->nchan > 1)
+        bond_reorder();
+}
+
+/* Test socket send/receive on every channel */
+void chan_io(void)
+{
+    int ready, i;
+
+    for (i = 0; i < st->nchan; i++) {
+        ch = st->chan[i];
+        if (mode_loop == LOOP_SIM) /* what is sent is received at once, by sim_send() */
+            ready = SOCK_WR;
+        else
+#ifdef HAVE_IO_URING
+        if (mode_loop == LOOP_URING)
+            ready = uring_poll();
+        else
+#endif
+#ifdef HAVE_EPOLL
+        if (mode_loop == LOOP_EPOLL)
+            ready = epoll_poll();
+        else
+#endif
+            ready = select_poll();
+     
         /* socket send */
-        if (FD_ISSET(sock, &wfd)) 
+        if (ready & SOCK_WR) 
             socket_send();
 
         /* socket receive */
-        if (FD_ISSET(sock, &rfd)) 
+        if (ready & SOCK_RD) 
             socket_recv();
+    }
+    ch = st->chan[0];
+}
 
-        /* network layer event */
-        if (network_layer_ready()) {
-            layer3_ready = 1;
-            return NETWORK_LAYER_READY;
-        }
+/* One pass over everything a station has to do, returns its next event or -1 if there is none yet */
+int phl_poll(int *arg)
+{
+    int event;
+
+    st->now_us = get_us();
+    st->now = (int)(st->now_us / 1000);
+
+    /* frames and headers already assembled, in line order */
+    if (st->rf_head)
+        return FRAME_RECEIVED;
+    if (st->rf_hdr_ready)
+        return FRAME_HEADER;
+ 
+#ifdef HAVE_PHY_THREAD
+    if (st->phy)
+        phy_collect();
+    else
+#endif
+    chan_commit();
+    if (st->rf_head)
+        return FRAME_RECEIVED;
+    if (st->rf_hdr_ready)
+        return FRAME_HEADER;
+    
+#ifdef HAVE_PHY_THREAD
+    if (st->phy == NULL)
+#endif
+    chan_io();
 
-        /* check all timers */
-        if ((event = scan_timer(arg)) != 0)
-            return event;
+    /* network layer event */
+    if (network_layer_ready()) {
+        st->layer3_ready = 1;
+        return NETWORK_LAYER_READY;
+    }
 
-        /* physical layer event */
-        if (inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
-            inform_phl_ready = 0;
-            return PHYSICAL_LAYER_READY;
-        }
+    /* check all timers */
+    if ((event = scan_timer(arg)) != 0)
+        return event;
 
-        /* delay 'mode_tick' ms */
-        if (1) {
-            int ms0, t;
-            static time_t last_warn;
-            ms0 = get_ms();
-            magic_check();
-            Sleep(mode_tick);
-            t = get_ms() - ms0;
-            if (t > mode_tick + 50 && time(0) > last_warn + 1) {
-                lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
-                    mode_tick, t);
-                last_warn = time(0);
-            }
-        } else {
-            int ticks, ms;
-
-            sleep_cnt++;
-
-            ms = get_ms();
-            if (start_ms == 0)
-                start_ms = ms;
-            else if (ms - wakeup_ms > 1) {
-                ticks = (ms - start_ms) / mode_tick;
-                lprintf("====== CPU BUSY for %d ms (cnt %d)\n", ms - wakeup_ms, ++busy_cnt);
-                lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
-            }
-
-            magic_check();
-            ms = get_ms();
-            Sleep(mode_tick);
-            wakeup_ms = get_ms();
-
-            ms = wakeup_ms - ms;
-            if (ms > mode_tick + 1 || ms < mode_tick - 1) 
-                lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
-        }
+    /* physical layer event */
+    if (st->inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
+        st->inform_phl_ready = 0;
+        return PHYSICAL_LAYER_READY;
+    }
+
+    return -1;
+}
+
+int wait_for_event(int *arg)
+{
+    int event;
+
+#ifdef HAVE_PHY_THREAD
+    if (st->phy && !st->phy->started)
+        phy_start();
+#endif
+
+    for (;;) {
+
+        if ((event = phl_poll(arg)) >= 0)
+            return event;
 
-        if (now > mode_life) {
+        /* sleep until the next deadline, or delay 'mode_tick' ms */
+#ifdef HAVE_PHY_THREAD
+        if (st->phy)
+            phy_sleep();
+        else
+#endif
+#ifdef HAVE_IO_URING
+        if (mode_loop == LOOP_URING)
+            uring_sleep();
+        else
+#endif
+#ifdef HAVE_EPOLL
+        if (mode_loop == LOOP_EPOLL)
+            epoll_sleep();
+        else
+#endif
+            tick_sleep();
+
+        if (st->now > mode_life) {
             lprintf("Quit.\n");
             exit(0);
         }
     }
 }
 
+void protocol_run(int argc, char **argv, int ctx_size,
+    void (*init)(void *ctx), void (*handler)(void *ctx, int event, int arg))
+{
+    void *ctx;
+    int event, arg;
+
+    layer2_ctx_size = ctx_size;
+    layer2_init = init;
+    layer2_handler = handler;
+
+    protocol_init(argc, argv);
+#ifdef HAVE_ENGINE
+    if (mode_links) {
+        engine_run();
+        exit(0);
+    }
+#endif
+    if (mode_sim) {
+        sim_run();
+        exit(0);
+    }
+
+    ctx = calloc(1, ctx_size > 0 ? ctx_size : 1);
+    if (ctx == NULL)
+        ABORT("No enough memory");
+    init(ctx);
+
+    for (;;) {
+        event = wait_for_event(&arg);
+        handler(ctx, event, arg);
+    }
+}
+
+int phl_links(void)
+{
+    return mode_sim ? 1 : mode_links;
+}
 
 /* Memory Protection */
 static unsigned int foot_magic[NMAGIC];
@@ -903,7 +2325,7 @@ static void magic_init(void)
     }
 }
 
-static void magic_check(void)
+void magic_check(void)
 {
     int i;
 
@@ -21,11 +21,25 @@ extern void protocol_init(int argc, char **argv);
 /* Event Driver */
 extern int wait_for_event(int *arg);
 
+/* 
+    Instead of protocol_init() and a wait_for_event() loop: calls 'init'
+    once on a zeroed context of 'ctx_size' bytes, then 'handler' for 
+    every event. With --links the process runs many stations, each
+    with a context of its own, on one or more threads, and with --sim
+    both stations of one link; the calls above act on the station the
+    handler was called for. Never returns.
+*/
+extern void protocol_run(int argc, char **argv, int ctx_size,
+    void (*init)(void *ctx), void (*handler)(void *ctx, int event, int arg));
+/* Links run by this process (--links, or the one of --sim), 0 for a single station */
+extern int  phl_links(void);
+
 #define NETWORK_LAYER_READY  0
 #define PHYSICAL_LAYER_READY 1
 #define FRAME_RECEIVED       2
 #define DATA_TIMEOUT         3
 #define ACK_TIMEOUT          4
+#define FRAME_HEADER         5 /* cut-through: header of a frame still on the line */
 
 /* Network Layer functions */
 #define PKT_LEN 256
@@ -37,6 +51,24 @@ extern void put_packet(unsigned char *packet, int len);
 
 /* Physical Layer functions */
 extern int  recv_frame(unsigned char *buf, int size);
+/* As recv_frame(), *good tells whether the frame passed the negotiated FCS */
+extern int  recv_frame_fcs(unsigned char *buf, int size, int *good);
+/* 
+    Lease the oldest received frame instead of copying it: *frame and *len
+    stay valid until recv_frame_release(), which must come before the next
+    wait_for_event(). Returns nonzero if the frame passed the FCS.
+*/
+extern int  recv_frame_peek(unsigned char **frame, int *len);
+extern void recv_frame_release(void);
+
+/* 
+    Cut-through: when both stations agreed on it, returns nonzero and 
+    raises FRAME_HEADER as soon as a frame longer than 'hdr_len' bytes
+    has its first 'hdr_len' bytes in. recv_frame_header() then gives 
+    those bytes, still unchecked.
+*/
+extern int  phl_cut_through(int hdr_len);
+extern int  recv_frame_header(unsigned char *buf, int size);
 extern void send_frame(unsigned char *frame, int len);
 
 extern int  phl_sq_len(void);
@@ -44,11 +76,59 @@ extern int  phl_sq_len(void);
 /* CRC-32 polynomium coding function */
 extern unsigned int crc32(unsigned char *buf, int len);
 
-/* Timer Management functions */
+/* CRC-32 engine ("byte", "slice8", "slice16", "clmul" or "auto"), chosen by fcs_select() or on first use */
+extern int crc32_set_engine(const char *name);
+extern const char *crc32_engine(void);
+
+/* Incremental CRC-32: crc32_final(crc32_update(crc32_init(), buf, len)) == crc32(buf, len) */
+extern unsigned int crc32_init(void);
+extern unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len);
+extern unsigned int crc32_final(unsigned int crc);
+
+/* CRC-32 of A followed by B, from crc32() of each and the length of B */
+extern unsigned int crc32_combine(unsigned int crcA, unsigned int crcB, int lenB);
+
+/* RFC 1662 FCS-16 of buf, as sent (complemented) */
+extern unsigned int crc16(unsigned char *buf, int len);
+/* CRC-8 (x^8 + x^2 + x + 1, reflected), for short headers */
+extern unsigned int crc8(unsigned char *buf, int len);
+
+/* Frame Check Sequence, negotiated by both stations in protocol_init() */
+#define FCS_CRC32  0 /* CRC-32 register appended as is (default) */
+#define FCS_CRC32C 1 /* CRC-32C (Castagnoli) as iSCSI sends it, SSE4.2 crc32 instruction when available */
+#define FCS_16     2 /* RFC 1662 FCS-16 */
+#define FCS_32     3 /* RFC 1662 FCS-32 */
+
+/* Call before starting threads: it also picks the CRC engines and builds the fcs_combine() tables */
+extern int  fcs_select(int type);
+extern int  fcs_type(void);
+extern int  fcs_lookup(const char *name);
+extern const char *fcs_name(int type);
+extern int  fcs_len(void);
+
+/* Append the FCS to frame[0..len-1], return the new length */
+extern int  fcs_append(unsigned char *frame, int len);
+/* Nonzero if frame[0..len-1], FCS included, is good */
+extern int  fcs_check(unsigned char *frame, int len);
+
+/* Incremental FCS, for frames built from separately checked parts */
+extern unsigned int fcs_init(void);
+extern unsigned int fcs_update(unsigned int reg, unsigned char *buf, int len);
+extern unsigned int fcs_combine(unsigned int regA, unsigned int regB, int lenB);
+extern int  fcs_put(unsigned char *frame, int len, unsigned int reg);
+/* Nonzero if reg, taken over a whole frame FCS included, is the good residue */
+extern int  fcs_good(unsigned int reg);
+
+/* Timer Management functions, on a monotonic clock started at the shared epoch */
 extern unsigned int get_ms(void);
+extern long long get_us(void);
 extern void start_timer(unsigned int nr, unsigned int ms);
+extern void start_timer_us(unsigned int nr, unsigned int us);
 extern void stop_timer(unsigned int nr);
+/* ms left on DATA timer 'nr', 0 if it is stopped or has expired */
+extern int  get_timer(unsigned int nr);
 extern void start_ack_timer(unsigned int ms);
+extern void start_ack_timer_us(unsigned int us);
 extern void stop_ack_timer(void);
 
 /* Protocol Debugger */
@@ -0,0 +1,176 @@
+/*
+    With --shm the line bytes bypass the socket: each direction is a
+    single-producer single-consumer byte ring in one memfd mapping,
+    which station A creates and hands to station B over the link socket
+    (SCM_RIGHTS) together with an eventfd per ring. The socket itself
+    carries the handshake only.
+
+    A consumer about to sleep in epoll_wait() sets 'sleeping'; the
+    producer rings the eventfd only then, so a busy link makes no
+    system call at all. Pacing, delay and noise are untouched: the
+    sender still releases bytes through the pacer, and the receiver
+    copies them into the delay line exactly as socket_recv() does.
+*/
+
+#include "phl.h"
+
+#ifdef HAVE_SHM
+
+#define SHM_RING_SIZE (4 * 1024 * 1024) /* a power of 2 */
+
+struct SHM_RING {
+    unsigned int head;     /* consumer, free running */
+    char pad1[60];
+    unsigned int tail;     /* producer, free running */
+    char pad2[60];
+    int sleeping;          /* consumer waits for the eventfd */
+    int closed;            /* producer has quit */
+    char pad3[56];
+    unsigned char data[SHM_RING_SIZE];
+};
+
+static int shm_rx_len(void)
+{
+    return (int)(__atomic_load_n(&ch->shm_rx->tail, __ATOMIC_ACQUIRE) - ch->shm_rx->head);
+}
+
+/* Wake the consumer if it sleeps, returns -1 if that failed */
+static int shm_doorbell(void)
+{
+    unsigned long long one = 1;
+
+    /* pairs with the fence in shm_rx_idle(); only the one that clears 'sleeping' rings */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(&ch->shm_tx->sleeping, 0, __ATOMIC_ACQ_REL))
+        return 0;
+    st->loop_syscalls++;
+    return write(ch->shm_tx_efd, &one, sizeof(one)) < 0 ? -1 : 0;
+}
+
+/* Copy up to 'n' bytes into the ring, returns the number copied (0: full) */
+int shm_send(const unsigned char *buf, int n)
+{
+    unsigned int tail = ch->shm_tx->tail, room, pos, first;
+
+    room = SHM_RING_SIZE - (tail - __atomic_load_n(&ch->shm_tx->head, __ATOMIC_ACQUIRE));
+    if ((unsigned int)n > room)
+        n = (int)room;
+    if (n == 0)
+        return 0;
+
+    pos = tail & (SHM_RING_SIZE - 1);
+    first = (unsigned int)n < SHM_RING_SIZE - pos ? (unsigned int)n : SHM_RING_SIZE - pos;
+    memcpy(ch->shm_tx->data + pos, buf, first);
+    memcpy(ch->shm_tx->data, buf + first, n - first);
+    __atomic_store_n(&ch->shm_tx->tail, tail + n, __ATOMIC_RELEASE);
+
+    if (shm_doorbell() < 0)
+        ABORT("system write(eventfd)");
+    return n;
+}
+
+static void shm_copy_out(unsigned int pos, unsigned char *p, unsigned int n)
+{
+    unsigned int first = n < SHM_RING_SIZE - pos ? n : SHM_RING_SIZE - pos;
+
+    memcpy(p, ch->shm_rx->data + pos, first);
+    memcpy(p + first, ch->shm_rx->data, n - first);
+}
+
+/* Copy up to n1 + n2 bytes out of the ring into two pieces, returns the number copied */
+int shm_recv(unsigned char *p1, unsigned int n1, unsigned char *p2, unsigned int n2)
+{
+    unsigned int head = ch->shm_rx->head, n = (unsigned int)shm_rx_len(), k;
+
+    if (n == 0) {
+        if (__atomic_load_n(&ch->shm_rx->closed, __ATOMIC_ACQUIRE) && shm_rx_len() == 0)
+            link_closed();
+        return 0;
+    }
+    if (n > n1 + n2)
+        n = n1 + n2;
+
+    k = n < n1 ? n : n1;
+    shm_copy_out(head & (SHM_RING_SIZE - 1), p1, k);
+    shm_copy_out((head + k) & (SHM_RING_SIZE - 1), p2, n - k);
+    __atomic_store_n(&ch->shm_rx->head, head + n, __ATOMIC_RELEASE);
+    return (int)n;
+}
+
+/* Before sleeping on the eventfd (on != 0) and after; returns nonzero if bytes are waiting */
+int shm_rx_idle(int on)
+{
+    __atomic_store_n(&ch->shm_rx->sleeping, on, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return shm_rx_len() > 0 || __atomic_load_n(&ch->shm_rx->closed, __ATOMIC_RELAXED);
+}
+
+/* At exit: the consumer sees the link close once it has read everything */
+static void shm_close(void)
+{
+    __atomic_store_n(&ch->shm_tx->closed, 1, __ATOMIC_RELEASE);
+    shm_doorbell();
+}
+
+/* Station A creates the rings and passes them on, station B picks them up */
+void shm_init(void)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct SHM_RING *ring;
+    int fds[3], i;
+    char c = 'S';
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    if (st->station == 'a') {
+        /* fds[0]: the memfd, fds[1]: doorbell of ring 0 (A to B), fds[2]: of ring 1 (B to A) */
+        fds[0] = (int)syscall(__NR_memfd_create, "datalink", MFD_CLOEXEC);
+        if (fds[0] < 0 || ftruncate(fds[0], 2 * sizeof(struct SHM_RING)) < 0)
+            ABORT("system memfd_create()");
+        fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[1] < 0 || fds[2] < 0)
+            ABORT("system eventfd()");
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        if (sendmsg(ch->sock, &msg, 0) != 1)
+            ABORT("Station A failed to pass the shared memory rings");
+    } else {
+        cmsg = NULL;
+        if (recvmsg(ch->sock, &msg, 0) == 1)
+            cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+            ABORT("Station B failed to pick up the shared memory rings");
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    ring = (struct SHM_RING *)mmap(NULL, 2 * sizeof(struct SHM_RING), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (ring == MAP_FAILED)
+        ABORT("system mmap(memfd)");
+    close(fds[0]);
+
+    i = st->station == 'a' ? 0 : 1;
+    ch->shm_tx = &ring[i];
+    ch->shm_tx_efd = fds[1 + i];
+    ch->shm_rx = &ring[1 - i];
+    ch->shm_rx_efd = fds[2 - i];
+    atexit(shm_close);
+}
+
+#endif /* HAVE_SHM */
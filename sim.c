@@ -0,0 +1,161 @@
+/*
+    A simulation (--sim) runs station A and B in this process, on one
+    thread, with get_us() reading a virtual clock. What a station sends
+    goes straight into the delay line of the peer's channel, so nothing
+    happens between deadlines: a pass runs every station that is due
+    until it has no event left, and the clock then jumps to the earliest
+    next_deadline() of the two. Nothing depends on the wall clock or
+    the scheduler; the same --seed gives the same run, to the bit.
+*/
+
+#include "phl.h"
+
+static struct STATION *sim_sts[2];
+
+/* link_send() of a simulation: into the peer's delay line, 0 if that is full */
+int sim_send(const unsigned char *buf, int n)
+{
+    struct STATION *self = st;
+    struct CHANNEL *c = ch;
+    unsigned int pos, first;
+
+    st = sim_sts[self == sim_sts[0]];
+    ch = st->chan[c->nr];
+    if ((unsigned int)n > dl_room())
+        n = (int)dl_room();
+    if (n > 0) {
+        pos = ch->dl_tail & ch->dl_mask;
+        first = (unsigned int)n < ch->dl_size - pos ? (unsigned int)n : ch->dl_size - pos;
+        memcpy(ch->dl + pos, buf, first);
+        memcpy(ch->dl, buf + first, n - first);
+        st->now_us = self->now_us;
+        dl_append(n);
+    } else
+        c->tx_blocked = 1;
+
+    st = self;
+    ch = c;
+    return n;
+}
+
+static void sim_station(int i)
+{
+    struct STATION *s;
+    int k;
+
+    s = (struct STATION *)malloc(sizeof(struct STATION));
+    if (s == NULL)
+        ABORT("No enough memory");
+    station_init(s);
+    station_enter(s);
+    s->station = i == 0 ? 'a' : 'b';
+    s->seed = (unsigned int)(mode_seed ^ (i == 0 ? 97209 : 18231));
+
+    for (k = 1; k < mode_bond; k++) {
+        ch = (struct CHANNEL *)malloc(sizeof(struct CHANNEL));
+        if (ch == NULL)
+            ABORT("No enough memory");
+        channel_init(ch, k);
+        st->chan[st->nchan++] = ch;
+    }
+    bond_rates();
+    for (k = 0; k < st->nchan; k++) {
+        ch = st->chan[k];
+        delay_line_init();
+        pacer_init();
+    }
+    ch = st->chan[0];
+
+    s->ctx = calloc(1, layer2_ctx_size > 0 ? layer2_ctx_size : 1);
+    if (s->ctx == NULL)
+        ABORT("No enough memory");
+    sim_sts[i] = s;
+    layer2_init(s->ctx);
+}
+
+static void sim_report(void)
+{
+    struct STATION *s;
+    double bps;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        s = sim_sts[i];
+        station_enter(s);
+        bps = s->now > s->ts0 ? (double)s->rbytes * 8 * 1000 / (s->now - s->ts0) : 0.0;
+        lprintf("Station %s: %u frames sent, %d packets received, %.0f bps (%.2f%%), Err %d (%.1e)\n",
+            station_name(), s->tx_frames, s->rpackets, bps, bps / s->chan_bps * 100, s->noise,
+            s->nbits ? (double)s->noise / s->nbits : 0.0);
+        if (s->nchan > 1)
+            bond_report();
+    }
+}
+
+void sim_run(void)
+{
+    struct STATION *s;
+    long long life = (mode_life + 1) * 1000LL, next, t0 = mono_us();
+    unsigned int passes = 0;
+    int i, k, event, nr;
+
+    sim_us = 0;
+    if (mode_fcs < 0)
+        mode_fcs = FCS_CRC32;
+    for (i = 0; i < mode_bond; i++) {
+        if (mode_rate[i] == 0)
+            mode_rate[i] = CHAN_BPS;
+    }
+    fcs_select(mode_fcs);
+
+    for (i = 0; i < 2; i++)
+        sim_station(i);
+
+    s = sim_sts[0];
+    lprintf("Line rate %d bps, frame check sequence: %s%s, seed 0x%08x\n", s->chan_bps, fcs_name(fcs_type()),
+        mode_cut_through ? ", cut-through" : "", (unsigned int)mode_seed);
+    if (s->nchan > 1) {
+        lprintf("Bonding: %d channels of", s->nchan);
+        for (i = 0; i < s->nchan; i++)
+            lprintf("%s %d", i ? " +" : "", s->chan[i]->bps);
+        lprintf(" bps\n");
+    }
+    lprintf("=================================================================\n\n");
+
+    while (sim_us < life) {
+        for (i = 0; i < 2; i++) {
+            s = sim_sts[i];
+            if (s->due > sim_us)
+                continue;
+            station_enter(s);
+            while ((event = phl_poll(&nr)) >= 0)
+                layer2_handler(s->ctx, event, nr);
+        }
+        magic_check();
+
+        /* room made in a delay line lets the peer's channel send again */
+        for (i = 0; i < 2; i++) {
+            for (k = 0; k < sim_sts[i]->nchan; k++) {
+                ch = sim_sts[i]->chan[k];
+                if (dl_room())
+                    sim_sts[1 - i]->chan[k]->tx_blocked = 0;
+            }
+        }
+
+        /* both, as either may have sent to the other */
+        next = life;
+        for (i = 0; i < 2; i++) {
+            station_enter(sim_sts[i]);
+            sim_sts[i]->due = next_deadline();
+            if (sim_sts[i]->due < next)
+                next = sim_sts[i]->due;
+        }
+        sim_us = next > sim_us ? next : sim_us + 1;
+        passes++;
+    }
+
+    sim_report();
+    /* the console only: the log is the same for every run of a seed */
+    printf("Simulated %.1f s in %.2f s (%.0fx real time), %u passes\n", life / 1e6, (mono_us() - t0) / 1e6,
+        life / ((mono_us() - t0) + 1.0), passes);
+    lprintf("Quit.\n");
+}
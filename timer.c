@@ -0,0 +1,226 @@
+/*
+    Hashed timer wheel
+
+    A timer due at time t sits in slot (t >> shift) % TW_SLOTS. Timers
+    more than one revolution away share slots with nearer ones and are
+    passed over until their turn comes. A bitmap of occupied slots lets
+    expiry and tw_next() skip empty slots a word at a time.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define TW_SLOTS 1024 /* slots per revolution, a power of 2 */
+#define TW_MASK  (TW_SLOTS - 1)
+#define TW_WORDS (TW_SLOTS / 64)
+
+#ifdef __GNUC__
+#define tw_ctz(x) __builtin_ctzll(x)
+#else
+static int tw_ctz(unsigned long long x)
+{
+    int n = 0;
+
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
+struct tw_node {
+    long long deadline; /* 0: stopped */
+    int slot;
+    int prev, next;     /* node indexes, -1 terminated */
+};
+
+struct timer_wheel {
+    struct tw_node *node;
+    unsigned int nnode;
+    int count;
+    int shift;
+    long long cursor; /* slots before this one have been expired */
+    int head[TW_SLOTS], tail[TW_SLOTS];
+    unsigned long long used[TW_WORDS];
+};
+
+struct timer_wheel *tw_create(int shift)
+{
+    struct timer_wheel *tw;
+    int i;
+
+    tw = (struct timer_wheel *)calloc(1, sizeof(struct timer_wheel));
+    if (tw == NULL)
+        return NULL;
+    tw->shift = shift;
+    for (i = 0; i < TW_SLOTS; i++)
+        tw->head[i] = tw->tail[i] = -1;
+    return tw;
+}
+
+void tw_destroy(struct timer_wheel *tw)
+{
+    if (tw) {
+        free(tw->node);
+        free(tw);
+    }
+}
+
+static void tw_unlink(struct timer_wheel *tw, int i)
+{
+    struct tw_node *n = &tw->node[i];
+
+    if (n->prev >= 0)
+        tw->node[n->prev].next = n->next;
+    else
+        tw->head[n->slot] = n->next;
+    if (n->next >= 0)
+        tw->node[n->next].prev = n->prev;
+    else
+        tw->tail[n->slot] = n->prev;
+
+    if (tw->head[n->slot] < 0)
+        tw->used[n->slot / 64] &= ~(1ULL << (n->slot % 64));
+
+    n->deadline = 0;
+    tw->count--;
+}
+
+int tw_start(struct timer_wheel *tw, unsigned int id, long long deadline)
+{
+    struct tw_node *n;
+    unsigned int size;
+    long long s;
+    int slot;
+
+    if (id >= tw->nnode) {
+        for (size = tw->nnode ? tw->nnode : 64; size <= id; size *= 2)
+            if (size > 0x7fffffff / 2)
+                return 0;
+        n = (struct tw_node *)realloc(tw->node, size * sizeof(struct tw_node));
+        if (n == NULL)
+            return 0;
+        memset(n + tw->nnode, 0, (size - tw->nnode) * sizeof(struct tw_node));
+        tw->node = n;
+        tw->nnode = size;
+    }
+
+    n = &tw->node[id];
+    if (n->deadline)
+        tw_unlink(tw, (int)id);
+
+    if (deadline <= 0)
+        deadline = 1;
+
+    /* already due: expire on the next tw_expire() */
+    s = deadline >> tw->shift;
+    slot = (int)((s > tw->cursor ? s : tw->cursor) & TW_MASK);
+
+    n->deadline = deadline;
+    n->slot = slot;
+    n->next = -1;
+    n->prev = tw->tail[slot];
+    if (n->prev >= 0)
+        tw->node[n->prev].next = (int)id;
+    else
+        tw->head[slot] = (int)id;
+    tw->tail[slot] = (int)id;
+    tw->used[slot / 64] |= 1ULL << (slot % 64);
+    tw->count++;
+
+    return 1;
+}
+
+void tw_stop(struct timer_wheel *tw, unsigned int id)
+{
+    if (id < tw->nnode && tw->node[id].deadline)
+        tw_unlink(tw, (int)id);
+}
+
+long long tw_deadline(struct timer_wheel *tw, unsigned int id)
+{
+    return id < tw->nnode ? tw->node[id].deadline : 0;
+}
+
+int tw_count(struct timer_wheel *tw)
+{
+    return tw->count;
+}
+
+/* First occupied slot at or after slot 'from', as a slot number; -1 if none */
+static long long tw_scan(struct timer_wheel *tw, long long from)
+{
+    int s = (int)(from & TW_MASK), w = s / 64, k;
+    unsigned long long bits;
+
+    if (tw->count == 0)
+        return -1;
+
+    bits = tw->used[w] & (~0ULL << (s % 64));
+    for (k = 0; k <= TW_WORDS; k++) {
+        if (bits)
+            return from + ((w * 64 + tw_ctz(bits) - s) & TW_MASK);
+        w = (w + 1) % TW_WORDS;
+        bits = tw->used[w];
+        if (k == TW_WORDS - 1) /* back in the first word: bits below s only */
+            bits &= (1ULL << (s % 64)) - 1;
+    }
+    return -1;
+}
+
+/* Earliest timer of slot 'cursor' in this revolution due by 'now', -1 if none */
+static int tw_due(struct timer_wheel *tw, long long cursor, long long now)
+{
+    int i, best = -1;
+
+    for (i = tw->head[cursor & TW_MASK]; i >= 0; i = tw->node[i].next) {
+        if ((tw->node[i].deadline >> tw->shift) <= cursor && tw->node[i].deadline <= now &&
+            (best < 0 || tw->node[i].deadline < tw->node[best].deadline))
+            best = i;
+    }
+    return best;
+}
+
+long long tw_expire(struct timer_wheel *tw, long long now, unsigned int *id)
+{
+    long long d, last = now >> tw->shift;
+    int best;
+
+    while (tw->cursor <= last) {
+        /* earliest first, ties in start order */
+        best = tw_due(tw, tw->cursor, now);
+        if (best >= 0) {
+            d = tw->node[best].deadline;
+            tw_unlink(tw, best);
+            *id = (unsigned int)best;
+            return d;
+        }
+
+        if (tw->cursor == last)
+            break;
+        d = tw_scan(tw, tw->cursor + 1);
+        tw->cursor = d < 0 || d > last ? last : d;
+    }
+    return 0;
+}
+
+long long tw_next(struct timer_wheel *tw)
+{
+    long long s = tw->cursor, t;
+    int i, k;
+
+    /* the first occupied slot holding a timer of its own revolution */
+    for (k = 0; k <= TW_SLOTS && (s = tw_scan(tw, s)) >= 0; k++, s++) {
+        t = 0;
+        for (i = tw->head[s & TW_MASK]; i >= 0; i = tw->node[i].next) {
+            if ((tw->node[i].deadline >> tw->shift) <= s && (t == 0 || tw->node[i].deadline < t))
+                t = tw->node[i].deadline;
+        }
+        if (t)
+            return t;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+    Hashed timer wheel, one slot per 2^shift time units.
+
+    Timers are numbered 0, 1, 2, ... with no upper bound; deadlines are
+    absolute times in any unit (protocol.c uses get_us() microseconds),
+    0 meaning stopped. Start, stop and expiry are O(1); timers expire in
+    deadline order, equal deadlines in the order they were started.
+*/
+struct timer_wheel;
+
+extern struct timer_wheel *tw_create(int shift);
+extern void tw_destroy(struct timer_wheel *tw);
+
+/* (Re)start timer 'id', returns 0 when out of memory */
+extern int  tw_start(struct timer_wheel *tw, unsigned int id, long long deadline);
+extern void tw_stop(struct timer_wheel *tw, unsigned int id);
+/* Deadline of timer 'id', 0 if stopped */
+extern long long tw_deadline(struct timer_wheel *tw, unsigned int id);
+extern int  tw_count(struct timer_wheel *tw);
+
+/* Stop the earliest timer due at 'now' and return its deadline, 0 if none is due */
+extern long long tw_expire(struct timer_wheel *tw, long long now, unsigned int *id);
+/* No timer is due before the returned time, 0 if no timer is running */
+extern long long tw_next(struct timer_wheel *tw);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif